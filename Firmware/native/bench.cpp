@@ -0,0 +1,203 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//Native micro benchmark of the USB host parsers (usbh_xinput_poll and the protocol parse functions)
+//and the Duke/Steel Battalion mappers in master.cpp. Run with the PlatformIO 'native' env:
+//  pio run -e native && .pio/build/native/program [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+//Pull in the master translation unit so the static mappers can be called directly.
+#include "../src/master.cpp"
+
+#include "devices.h"
+
+usbd_controller_t usbd_c[MAX_GAMEPADS];
+
+#define BENCH_DEFAULT_ITERATIONS 200000
+
+static double ns_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void print_result(double total_ns, uint32_t iterations)
+{
+    double per_call = total_ns / iterations;
+    printf(" %10.1f %12.0f", per_call, 1e9 / per_call);
+}
+
+//Whole master_task() iterations with 1-4 wired pads attached, all players in the same mode.
+static void bench_master_task(uint32_t iterations, xid_type_t mode)
+{
+    const native_device_t *bd = &native_devices[XBOX360_WIRED];
+    static usb_native_device_t devs[MAX_GAMEPADS];
+    static uint8_t reports[DEVICE_REPORT_VARIANTS][EP_MAXPKTSIZE];
+    uint8_t addr[MAX_GAMEPADS];
+    std::vector<double> samples(iterations);
+
+    for (uint8_t v = 0; v < DEVICE_REPORT_VARIANTS; v++)
+    {
+        make_report(bd->type, reports[v], bd->report_len, v);
+    }
+
+    for (uint8_t players = 1; players <= MAX_GAMEPADS; players++)
+    {
+        for (uint8_t i = 0; i < players; i++)
+        {
+            native_device_init(&devs[i], bd);
+            USBDeviceConfig *driver = native_enumerate(&devs[i], i + 1);
+            addr[i] = (driver) ? driver->GetAddress() : 0;
+        }
+
+        master_task();
+        for (uint8_t i = 0; i < players; i++)
+        {
+            usbd_c[i].type = mode;
+        }
+
+        for (uint32_t n = 0; n < iterations; n++)
+        {
+            for (uint8_t i = 0; i < players; i++)
+            {
+                UsbHost.native_set_report(addr[i], bd->in_ep, reports[(n + i) % DEVICE_REPORT_VARIANTS], bd->report_len, true);
+            }
+            native_advance_us(DEVICE_POLL_US);
+            auto start = std::chrono::steady_clock::now();
+            master_task();
+            samples[n] = ns_since(start);
+        }
+
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (uint32_t n = 0; n < iterations; n++)
+        {
+            sum += samples[n];
+        }
+        printf("master_task %-5s players=%u %10.1f %10.1f %10.1f %10.1f\n",
+               (mode == DUKE) ? "DUKE" : "SB", players, samples[0], sum / iterations,
+               samples[(iterations * 99 + 99) / 100 - 1], samples[iterations - 1]);
+
+        for (uint8_t i = 0; i < players; i++)
+        {
+            UsbHost.native_detach(addr[i]);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : BENCH_DEFAULT_ITERATIONS;
+    if (iterations == 0)
+        iterations = BENCH_DEFAULT_ITERATIONS;
+
+    master_init();
+
+    printf("ogx360 native benchmark, %u iterations per case (ns/call, calls/s)\n", iterations);
+    printf("%-20s %10s %12s %10s %12s %10s %12s %10s %12s\n", "type",
+           "idle", "parse/s", "active", "parse/s", "duke", "duke/s", "sb", "sb/s");
+
+    for (uint8_t d = 0; d < sizeof(native_devices) / sizeof(native_devices[0]); d++)
+    {
+        const native_device_t *bd = &native_devices[d];
+        usb_native_device_t dev;
+        native_device_init(&dev, bd);
+
+        printf("%-20s", bd->name);
+        USBDeviceConfig *driver = native_enumerate(&dev, 1);
+        if (driver == NULL)
+        {
+            printf(" not claimed by any driver\n");
+            continue;
+        }
+        uint8_t addr = driver->GetAddress();
+
+        //Wireless pads must announce themselves before the receiver allocates a slot.
+        if (bd->type == XBOX360_WIRELESS)
+        {
+            static const uint8_t connected[] = {0x08, 0x80};
+            UsbHost.native_set_report(addr, bd->in_ep, connected, sizeof(connected), false);
+            native_advance_us(DEVICE_POLL_US);
+            usbh_xinput_poll();
+            usbh_xinput_finish_transfers(NULL);
+        }
+
+        usbh_xinput_t *xpad = NULL;
+        usbh_xinput_t *usbh_head = usbh_xinput_get_device_list();
+        for (uint8_t i = 0; i < XINPUT_MAXGAMEPADS; i++)
+        {
+            if (usbh_head[i].bAddress == addr)
+                xpad = &usbh_head[i];
+        }
+        if (xpad == NULL)
+        {
+            printf(" no pad allocated\n");
+            UsbHost.native_detach(addr);
+            continue;
+        }
+
+        static uint8_t reports[DEVICE_REPORT_VARIANTS][EP_MAXPKTSIZE];
+        static usbh_xinput_t snapshots[DEVICE_REPORT_VARIANTS];
+        for (uint8_t v = 0; v < DEVICE_REPORT_VARIANTS; v++)
+        {
+            make_report(bd->type, reports[v], bd->report_len, v);
+            UsbHost.native_set_report(addr, bd->in_ep, reports[v], bd->report_len, true);
+            native_advance_us(DEVICE_POLL_US);
+            usbh_xinput_poll();
+            usbh_xinput_finish_transfers(NULL);
+            snapshots[v] = *xpad;
+        }
+
+        //Identical report every poll, like an idle wired pad. The clock moves on every poll so
+        //the endpoint is always due.
+        UsbHost.native_set_report(addr, bd->in_ep, reports[0], bd->report_len, true);
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            native_advance_us(DEVICE_POLL_US);
+            usbh_xinput_poll();
+            usbh_xinput_finish_transfers(NULL);
+        }
+        print_result(ns_since(start), iterations);
+
+        //A new report every poll
+        start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            UsbHost.native_set_report(addr, bd->in_ep, reports[i % DEVICE_REPORT_VARIANTS], bd->report_len, true);
+            native_advance_us(DEVICE_POLL_US);
+            usbh_xinput_poll();
+            usbh_xinput_finish_transfers(NULL);
+        }
+        print_result(ns_since(start), iterations);
+
+        start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            *xpad = snapshots[i % DEVICE_REPORT_VARIANTS];
+            handle_duke(xpad, &usbd_c[0].duke, &user_data[0]);
+        }
+        print_result(ns_since(start), iterations);
+
+        start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            *xpad = snapshots[i % DEVICE_REPORT_VARIANTS];
+            handle_sbattalion(xpad, &usbd_c[0].sb, &user_data[0]);
+        }
+        print_result(ns_since(start), iterations);
+        printf("\n");
+
+        UsbHost.native_detach(addr);
+    }
+
+    printf("\n%-29s %10s %10s %10s %10s (ns)\n", "", "min", "avg", "p99", "max");
+    bench_master_task(iterations, DUKE);
+    bench_master_task(iterations, STEELBATTALION);
+
+    return 0;
+}
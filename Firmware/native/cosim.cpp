@@ -0,0 +1,181 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//Co-simulation of one master and up to three slave modules on a shared simulated TWI bus.
+//The master runs master.cpp against scripted wired pads, each slave runs its own copy of slave.cpp.
+//Run with the PlatformIO 'native_cosim' env:
+//  pio run -e native_cosim && .pio/build/native_cosim/program [iterations] [slaves] [duke|sb]
+//
+//Bus times come from the bit level model in native/shim/wire.cpp and exclude CPU time,
+//use the OGX360_profile env on hardware for that.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/master.cpp"
+#include "devices.h"
+
+#define COSIM_DEFAULT_ITERATIONS 10000
+#define COSIM_FRAME_NS 4000000ULL //Console polls the XID endpoints every 4ms
+
+usbd_controller_t usbd_c[MAX_GAMEPADS];
+
+//Each slave firmware image gets its own globals. Headers are already included so only
+//slave.cpp itself is compiled into the namespace, and the player id pins read back the node id.
+#define COSIM_SLAVE(n)                                                                 \
+    namespace slave##n                                                                 \
+    {                                                                                  \
+    TwoWire Wire;                                                                      \
+    usbd_controller_t usbd_c[MAX_GAMEPADS];                                            \
+    static int digitalRead(uint8_t pin)                                                \
+    {                                                                                  \
+        return (pin == PLAYER_ID1_PIN) ? ((n) >> 1) & 1 : (n) & 1;                     \
+    }                                                                                  \
+    static void delay(unsigned long ms)                                                \
+    {                                                                                  \
+        (void)ms;                                                                      \
+    }                                                                                  \
+    }
+
+COSIM_SLAVE(1)
+namespace slave1
+{
+#include "../src/slave.cpp"
+}
+COSIM_SLAVE(2)
+namespace slave2
+{
+#include "../src/slave.cpp"
+}
+COSIM_SLAVE(3)
+namespace slave3
+{
+#include "../src/slave.cpp"
+}
+
+typedef struct
+{
+    void (*init)(void);
+    usbd_controller_t *usbd_c;
+} cosim_slave_t;
+
+static const cosim_slave_t cosim_slaves[MAX_GAMEPADS - 1] = {
+    {slave1::slave_init, slave1::usbd_c},
+    {slave2::slave_init, slave2::usbd_c},
+    {slave3::slave_init, slave3::usbd_c},
+};
+
+typedef struct
+{
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+} cosim_stat_t;
+
+static void stat_add(cosim_stat_t *s, uint64_t v)
+{
+    if (v < s->min) s->min = v;
+    if (v > s->max) s->max = v;
+    s->sum += v;
+}
+
+static bool slave_matches(const usbd_controller_t *slave, const usbd_controller_t *master)
+{
+    if (slave->type != master->type)
+        return false;
+    if (master->type == DUKE)
+        return memcmp(&slave->duke.in, &master->duke.in, sizeof(usbd_duke_in_t)) == 0;
+    if (master->type == STEELBATTALION)
+        return memcmp(&slave->sb.in, &master->sb.in, sizeof(usbd_sbattalion_in_t)) == 0;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : COSIM_DEFAULT_ITERATIONS;
+    uint8_t num_slaves = (argc > 2) ? atoi(argv[2]) : MAX_GAMEPADS - 1;
+    xid_type_t mode = (argc > 3 && strcmp(argv[3], "sb") == 0) ? STEELBATTALION : DUKE;
+    if (iterations == 0)
+        iterations = COSIM_DEFAULT_ITERATIONS;
+    if (num_slaves > MAX_GAMEPADS - 1)
+        num_slaves = MAX_GAMEPADS - 1;
+
+    for (uint8_t s = 0; s < num_slaves; s++)
+    {
+        cosim_slaves[s].init();
+    }
+    master_init();
+
+    //One wired pad per player, player 1 on the master.
+    const native_device_t *nd = &native_devices[XBOX360_WIRED];
+    static usb_native_device_t devs[MAX_GAMEPADS];
+    static uint8_t reports[DEVICE_REPORT_VARIANTS][EP_MAXPKTSIZE];
+    uint8_t addr[MAX_GAMEPADS];
+    for (uint8_t v = 0; v < DEVICE_REPORT_VARIANTS; v++)
+    {
+        make_report(nd->type, reports[v], nd->report_len, v);
+    }
+    for (uint8_t i = 0; i <= num_slaves; i++)
+    {
+        native_device_init(&devs[i], nd);
+        USBDeviceConfig *driver = native_enumerate(&devs[i], i + 1);
+        addr[i] = (driver) ? driver->GetAddress() : 0;
+    }
+    master_task();
+    for (uint8_t i = 0; i <= num_slaves; i++)
+    {
+        usbd_c[i].type = mode;
+    }
+
+    memset(twi_bus.node, 0, sizeof(twi_bus.node));
+    twi_bus.bus_ns = 0;
+
+    cosim_stat_t frame = {UINT64_MAX, 0, 0};
+    cosim_stat_t latency[MAX_GAMEPADS];
+    uint32_t mismatches[MAX_GAMEPADS] = {0};
+    for (uint8_t s = 1; s < MAX_GAMEPADS; s++)
+    {
+        latency[s] = frame;
+    }
+
+    for (uint32_t n = 0; n < iterations; n++)
+    {
+        //New input on every pad, then one master frame.
+        for (uint8_t i = 0; i <= num_slaves; i++)
+        {
+            UsbHost.native_set_report(addr[i], nd->in_ep, reports[(n + i) % DEVICE_REPORT_VARIANTS], nd->report_len, true);
+        }
+
+        native_advance_us(COSIM_FRAME_NS / 1000);
+        uint64_t frame_start = twi_bus.bus_ns;
+        master_task();
+        stat_add(&frame, twi_bus.bus_ns - frame_start);
+
+        for (uint8_t s = 1; s <= num_slaves; s++)
+        {
+            stat_add(&latency[s], twi_bus.node[s].last_write_done_ns - frame_start);
+            if (!slave_matches(&cosim_slaves[s - 1].usbd_c[0], &usbd_c[s]))
+                mismatches[s]++;
+        }
+    }
+
+    printf("ogx360 co-simulation: 1 master + %u slaves, %s mode, %u frames, TWI at %u Hz\n",
+           num_slaves, (mode == DUKE) ? "DUKE" : "SB", iterations, twi_bus.clock);
+    printf("%-8s %12s %10s %12s %12s %12s %12s %10s\n", "slave", "xfers/frame", "bytes/frm",
+           "xfer us avg", "lat us min", "lat us avg", "lat us max", "mismatch");
+    for (uint8_t s = 1; s <= num_slaves; s++)
+    {
+        twi_node_stats_t *node = &twi_bus.node[s];
+        printf("%-8u %12.2f %10.1f %12.1f %12.1f %12.1f %12.1f %10u\n", s,
+               (double)node->transactions / iterations, (double)node->bytes / iterations,
+               node->transactions ? node->bus_ns / 1000.0 / node->transactions : 0.0,
+               latency[s].min / 1000.0, latency[s].sum / 1000.0 / iterations, latency[s].max / 1000.0,
+               mismatches[s]);
+    }
+    printf("bus busy per frame: min %.1f us, avg %.1f us, max %.1f us (%.1f%% of a %llu us console frame)\n",
+           frame.min / 1000.0, frame.sum / 1000.0 / iterations, frame.max / 1000.0,
+           100.0 * frame.sum / iterations / COSIM_FRAME_NS, COSIM_FRAME_NS / 1000);
+    printf("latency = bus time from the start of master_task() until the slave holds the new input report\n");
+
+    return 0;
+}
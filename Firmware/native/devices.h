@@ -0,0 +1,143 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//Scripted controllers for the native harnesses: descriptors for every xinput_type_t
+//and a generator for plausible IN reports.
+
+#ifndef _NATIVE_DEVICES_H_
+#define _NATIVE_DEVICES_H_
+
+#include <UHS2/Usb.h>
+#include "usbh/usbh_xinput.h"
+
+#define DEVICE_REPORT_VARIANTS 16
+#define DEVICE_POLL_US 10000 //Longer than any bInterval below, every pad endpoint is due again after this
+
+typedef struct
+{
+    const char *name;
+    xinput_type_t type;
+    const uint8_t *dev_desc;
+    const uint8_t *conf_desc;
+    uint16_t conf_len;
+    uint8_t in_ep;
+    uint8_t report_len;
+} native_device_t;
+
+#define DEV_DESC(vid, pid, cls, sub, proto) \
+    {0x12, 0x01, 0x00, 0x02, cls, sub, proto, 0x08, (vid) & 0xFF, (vid) >> 8, (pid) & 0xFF, (pid) >> 8, 0x14, 0x01, 0x01, 0x02, 0x03, 0x01}
+
+#define CONF_HDR(len, num_itf) 0x09, 0x02, (len) & 0xFF, (len) >> 8, num_itf, 0x01, 0x00, 0xA0, 0xFA
+#define ITF_DESC(num, eps, cls, sub, proto) 0x09, 0x04, num, 0x00, eps, cls, sub, proto, 0x00
+#define EP_DESC(addr, size, interval) 0x07, 0x05, addr, 0x03, size, 0x00, interval
+#define HID_DESC 0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x3F, 0x00
+#define XUSB_DESC 0x11, 0x21, 0x00, 0x01, 0x01, 0x25, 0x81, 0x14, 0x00, 0x00, 0x00, 0x00, 0x13, 0x01, 0x08, 0x00, 0x00
+#define XUSBW_DESC 0x14, 0x22, 0x00, 0x01, 0x13, 0x81, 0x1D, 0x00, 0x17, 0x01, 0x02, 0x08, 0x13, 0x01, 0x0C, 0x00, 0x0C, 0x01, 0x02, 0x08
+#define XUSBW_ITF(n) ITF_DESC(n, 2, 0xFF, 0x5D, 0x81), XUSBW_DESC, EP_DESC(0x81 + 2 * (n), 0x20, 0x01), EP_DESC(0x01 + 2 * (n), 0x20, 0x08)
+
+static const uint8_t unknown_dev[] = DEV_DESC(0x1234, 0x5678, 0xFF, 0xFF, 0xFF);
+static const uint8_t unknown_conf[] = {CONF_HDR(25, 1), ITF_DESC(0, 1, 0xFF, 0x00, 0x00), EP_DESC(0x81, 0x20, 0x04)};
+
+static const uint8_t xboxone_dev[] = DEV_DESC(0x045E, 0x02EA, 0xFF, 0x47, 0xD0);
+static const uint8_t xboxone_conf[] = {CONF_HDR(32, 1), ITF_DESC(0, 2, 0xFF, 0x47, 0xD0), EP_DESC(0x02, 0x40, 0x04), EP_DESC(0x82, 0x40, 0x04)};
+
+static const uint8_t xbox360w_dev[] = DEV_DESC(0x045E, 0x0719, 0xFF, 0xFF, 0xFF);
+static const uint8_t xbox360w_conf[] = {CONF_HDR(181, 4), XUSBW_ITF(0), XUSBW_ITF(1), XUSBW_ITF(2), XUSBW_ITF(3)};
+
+static const uint8_t xbox360_dev[] = DEV_DESC(0x045E, 0x028E, 0xFF, 0xFF, 0xFF);
+static const uint8_t xbox360_conf[] = {CONF_HDR(49, 1), ITF_DESC(0, 2, 0xFF, 0x5D, 0x01), XUSB_DESC, EP_DESC(0x81, 0x20, 0x04), EP_DESC(0x01, 0x20, 0x08)};
+
+static const uint8_t xboxog_dev[] = DEV_DESC(0x045E, 0x0202, 0x00, 0x00, 0x00);
+static const uint8_t xboxog_conf[] = {CONF_HDR(32, 1), ITF_DESC(0, 2, 0x58, 0x42, 0x00), EP_DESC(0x81, 0x20, 0x04), EP_DESC(0x02, 0x20, 0x04)};
+
+static const uint8_t keyboard_dev[] = DEV_DESC(0x046D, 0xC31C, 0x00, 0x00, 0x00);
+static const uint8_t keyboard_conf[] = {CONF_HDR(34, 1), ITF_DESC(0, 1, 0x03, 0x01, 0x01), HID_DESC, EP_DESC(0x81, 0x08, 0x0A)};
+
+static const uint8_t mouse_dev[] = DEV_DESC(0x046D, 0xC077, 0x00, 0x00, 0x00);
+static const uint8_t mouse_conf[] = {CONF_HDR(34, 1), ITF_DESC(0, 1, 0x03, 0x01, 0x02), HID_DESC, EP_DESC(0x81, 0x04, 0x0A)};
+
+static const uint8_t idle8bitdo_dev[] = DEV_DESC(0x2DC8, 0x3106, 0x00, 0x00, 0x00);
+static const uint8_t idle8bitdo_conf[] = {CONF_HDR(41, 1), ITF_DESC(0, 2, 0x03, 0x00, 0x00), HID_DESC, EP_DESC(0x81, 0x40, 0x01), EP_DESC(0x02, 0x40, 0x01)};
+
+static const uint8_t product_string[] = {0x0C, 0x03, 'o', 0, 'g', 0, 'x', 0, '3', 0, '6', 0};
+
+#define NATIVE_DEVICE(name, type, prefix, ep, len) {name, type, prefix##_dev, prefix##_conf, sizeof(prefix##_conf), ep, len}
+
+static const native_device_t native_devices[] = {
+    NATIVE_DEVICE("XINPUT_UNKNOWN", XINPUT_UNKNOWN, unknown, 0x81, 20),
+    NATIVE_DEVICE("XBOXONE", XBOXONE, xboxone, 0x82, 18),
+    NATIVE_DEVICE("XBOX360_WIRELESS", XBOX360_WIRELESS, xbox360w, 0x81, 29),
+    NATIVE_DEVICE("XBOX360_WIRED", XBOX360_WIRED, xbox360, 0x81, 20),
+    NATIVE_DEVICE("XBOXOG", XBOXOG, xboxog, 0x81, 20),
+    NATIVE_DEVICE("XINPUT_KEYBOARD", XINPUT_KEYBOARD, keyboard, 0x81, 8),
+    NATIVE_DEVICE("XINPUT_MOUSE", XINPUT_MOUSE, mouse, 0x81, 4),
+    NATIVE_DEVICE("XINPUT_8BITDO_IDLE", XINPUT_8BITDO_IDLE, idle8bitdo, 0x81, 8),
+};
+
+static inline void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+//Build a plausible IN report for the device type. Different variants hold different buttons and stick positions.
+static inline void make_report(xinput_type_t type, uint8_t *r, uint8_t len, uint8_t variant)
+{
+    uint16_t buttons = (variant * 0x1111) & 0xF3FF;
+    int16_t axis = (int16_t)(variant * 2047 - 16384);
+    memset(r, 0, len);
+    switch (type)
+    {
+    case XBOXONE:
+        r[0] = 0x20, r[2] = variant, r[3] = 0x0E;
+        put16(&r[4], buttons & 0xFFFC);
+        put16(&r[6], variant * 64), put16(&r[8], 1023 - variant * 64);
+        put16(&r[10], axis), put16(&r[12], -axis), put16(&r[14], axis / 2), put16(&r[16], -axis / 2);
+        break;
+    case XBOX360_WIRELESS:
+        r[1] = 0x01, r[3] = 0xF0, r[5] = 0x13;
+        put16(&r[6], buttons);
+        r[8] = variant * 16, r[9] = 255 - variant * 16;
+        put16(&r[10], axis), put16(&r[12], -axis), put16(&r[14], axis / 2), put16(&r[16], -axis / 2);
+        break;
+    case XBOX360_WIRED:
+        r[1] = 0x14;
+        put16(&r[2], buttons);
+        r[4] = variant * 16, r[5] = 255 - variant * 16;
+        put16(&r[6], axis), put16(&r[8], -axis), put16(&r[10], axis / 2), put16(&r[12], -axis / 2);
+        break;
+    case XBOXOG:
+        r[1] = 0x14;
+        put16(&r[2], buttons & 0x00FF);
+        for (uint8_t i = 4; i < 10; i++)
+            r[i] = (variant & (1 << (i & 3))) ? 0xFF : 0x00;
+        r[10] = variant * 16, r[11] = 255 - variant * 16;
+        put16(&r[12], axis), put16(&r[14], -axis), put16(&r[16], axis / 2), put16(&r[18], -axis / 2);
+        break;
+    default:
+        for (uint8_t i = 0; i < len; i++)
+            r[i] = variant + i;
+        break;
+    }
+}
+
+//Fill a shim device from a table entry, ready for native_enumerate().
+static inline void native_device_init(usb_native_device_t *dev, const native_device_t *nd)
+{
+    memset(dev, 0, sizeof(usb_native_device_t));
+    dev->dev_desc = nd->dev_desc;
+    dev->conf_desc = nd->conf_desc;
+    dev->conf_len = nd->conf_len;
+    dev->str_desc = product_string;
+}
+
+//Attaches a shim device and finishes its enumeration straight away, the firmware spreads it over
+//its first loops. Returns NULL if no driver claimed it.
+static inline USBDeviceConfig *native_enumerate(usb_native_device_t *dev, uint8_t port)
+{
+    USBDeviceConfig *driver = UsbHost.native_attach(dev, port);
+    XINPUT::FinishEnumeration();
+    return (driver && driver->GetAddress()) ? driver : NULL;
+}
+
+#endif
@@ -0,0 +1,276 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//Replays a capture of USB host IN reports (see xinput_capture_t in usbh_xinput.h) through
+//usbh_xinput_poll and the protocol parsers, then the Duke/Steel Battalion mappers in master.cpp.
+//Record a capture with the OGX360_capture env and save the raw Serial1 stream to a file.
+//Run with the PlatformIO 'native_replay' env:
+//  pio run -e native_replay && .pio/build/native_replay/program <capture> [passes] [duke|sb]
+//
+//Every captured device address is enumerated as the scripted device of its recorded type,
+//then each record is fed to that device once and the owning pad is mapped.
+
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/master.cpp"
+#include "devices.h"
+
+#define REPLAY_DEFAULT_PASSES 100
+#define REPLAY_MAX_DEVICES 8
+
+usbd_controller_t usbd_c[MAX_GAMEPADS];
+
+typedef struct
+{
+    xinput_capture_t hdr;
+    uint8_t data[EP_MAXPKTSIZE];
+} replay_record_t;
+
+typedef struct
+{
+    uint8_t capture_addr;
+    xinput_type_t type;
+    usb_native_device_t dev;
+    USBDeviceConfig *driver;
+    uint8_t addr;
+} replay_device_t;
+
+typedef struct
+{
+    uint32_t records;
+    double parse_ns;
+    uint32_t mapped;
+    double map_ns;
+} replay_stat_t;
+
+static replay_device_t devices[REPLAY_MAX_DEVICES];
+static uint8_t num_devices;
+
+static double ns_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+//Splits the raw stream into records. Bytes that don't start a plausible record are skipped
+//so a capture that was started mid stream still loads.
+static uint32_t load_capture(FILE *f, std::vector<replay_record_t> *records)
+{
+    std::vector<uint8_t> raw;
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        raw.insert(raw.end(), buf, buf + n);
+    }
+
+    uint32_t skipped = 0;
+    size_t pos = 0;
+    while (pos + sizeof(xinput_capture_t) <= raw.size())
+    {
+        replay_record_t rec;
+        memcpy(&rec.hdr, &raw[pos], sizeof(xinput_capture_t));
+        if (rec.hdr.sync != XINPUT_CAPTURE_SYNC || rec.hdr.len == 0 || rec.hdr.len > EP_MAXPKTSIZE ||
+            rec.hdr.type > XINPUT_8BITDO_IDLE || rec.hdr.bAddress == 0 ||
+            pos + sizeof(xinput_capture_t) + rec.hdr.len > raw.size())
+        {
+            pos++;
+            skipped++;
+            continue;
+        }
+        memcpy(rec.data, &raw[pos + sizeof(xinput_capture_t)], rec.hdr.len);
+        records->push_back(rec);
+        pos += sizeof(xinput_capture_t) + rec.hdr.len;
+    }
+    return skipped + (raw.size() - pos);
+}
+
+static replay_device_t *find_device(uint8_t capture_addr)
+{
+    for (uint8_t i = 0; i < num_devices; i++)
+    {
+        if (devices[i].capture_addr == capture_addr)
+            return &devices[i];
+    }
+    return NULL;
+}
+
+static replay_device_t *attach_device(uint8_t capture_addr, xinput_type_t type)
+{
+    if (num_devices == REPLAY_MAX_DEVICES)
+        return NULL;
+
+    replay_device_t *rd = &devices[num_devices];
+    rd->capture_addr = capture_addr;
+    rd->type = type;
+    native_device_init(&rd->dev, &native_devices[type]);
+    rd->driver = native_enumerate(&rd->dev, num_devices + 1);
+    rd->addr = (rd->driver) ? rd->driver->GetAddress() : 0;
+    num_devices++;
+    return rd;
+}
+
+//Queues a report on the endpoint and polls until the driver has read it. The capture follows the
+//endpoint schedule of the firmware that recorded it, but micros() stamps don't line up exactly
+//with millis() so the clock is nudged forward a ms at a time if the endpoint isn't due yet.
+//Returns the time spent in the usbh_xinput_poll() that read the report, including parsing it.
+static double poll_report(replay_device_t *rd, uint8_t ep, const uint8_t *data, uint8_t len)
+{
+    UsbHost.native_set_report(rd->addr, ep, data, len, false);
+    usb_native_device_t *dev = UsbHost.native_device(rd->addr);
+    double poll_ns = 0;
+    for (uint16_t ms = 0; ms <= UINT8_MAX && dev->in_report[ep] != NULL; ms++)
+    {
+        if (ms)
+            native_advance_us(1000);
+        auto start = std::chrono::steady_clock::now();
+        usbh_xinput_poll();
+        usbh_xinput_finish_transfers(NULL);
+        poll_ns = ns_since(start);
+    }
+    return poll_ns;
+}
+
+static usbh_xinput_t *find_pad(uint8_t addr, uint8_t ep, uint8_t *index)
+{
+    usbh_xinput_t *usbh_head = usbh_xinput_get_device_list();
+    for (uint8_t i = 0; i < XINPUT_MAXGAMEPADS; i++)
+    {
+        if (usbh_head[i].bAddress == addr && usbh_head[i].usbh_inPipe->epAddr == ep)
+        {
+            *index = i;
+            return &usbh_head[i];
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <capture> [passes] [duke|sb]\n", argv[0]);
+        return 1;
+    }
+    uint32_t passes = (argc > 2) ? strtoul(argv[2], NULL, 0) : REPLAY_DEFAULT_PASSES;
+    xid_type_t mode = (argc > 3 && strcmp(argv[3], "sb") == 0) ? STEELBATTALION : DUKE;
+    if (passes == 0)
+        passes = REPLAY_DEFAULT_PASSES;
+
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL)
+    {
+        printf("could not open %s\n", argv[1]);
+        return 1;
+    }
+    std::vector<replay_record_t> records;
+    uint32_t skipped = load_capture(f, &records);
+    fclose(f);
+    if (records.empty())
+    {
+        printf("no records in %s\n", argv[1]);
+        return 1;
+    }
+
+    master_init();
+    for (uint8_t i = 0; i < MAX_GAMEPADS; i++)
+    {
+        usbd_c[i].type = mode;
+    }
+
+    //A device keeps the type of its first record. Wireless pads are the only ones that change
+    //type once allocated, and they live on a receiver that was recorded as XBOX360_WIRELESS.
+    for (size_t r = 0; r < records.size(); r++)
+    {
+        if (find_device(records[r].hdr.bAddress))
+            continue;
+
+        replay_device_t *rd = attach_device(records[r].hdr.bAddress, (xinput_type_t)records[r].hdr.type);
+        if (rd == NULL)
+        {
+            printf("too many devices in capture, max %u\n", REPLAY_MAX_DEVICES);
+            return 1;
+        }
+        if (rd->driver == NULL)
+        {
+            printf("capture address %u (%s) not claimed by any driver, its records are ignored\n",
+                   rd->capture_addr, native_devices[rd->type].name);
+        }
+    }
+
+    uint32_t first = records.front().hdr.timestamp;
+    uint32_t duration_us = records.back().hdr.timestamp - first;
+    printf("ogx360 replay: %s, %zu records (%u bytes skipped), %u devices, %.3f s captured, %s mode, %u passes\n",
+           argv[1], records.size(), skipped, num_devices, duration_us / 1e6, (mode == DUKE) ? "DUKE" : "SB", passes);
+
+    replay_stat_t stats[XINPUT_8BITDO_IDLE + 1];
+    memset(stats, 0, sizeof(stats));
+    static const uint8_t connected[] = {0x08, 0x80};
+    double total_ns = 0;
+
+    //Replay time follows the capture timestamps, with a gap between passes.
+    for (uint32_t p = 0; p < passes; p++)
+    {
+        uint64_t pass_start_us = micros() + DEVICE_POLL_US;
+        for (size_t r = 0; r < records.size(); r++)
+        {
+            replay_record_t *rec = &records[r];
+            replay_device_t *rd = find_device(rec->hdr.bAddress);
+            if (rd->driver == NULL)
+                continue;
+
+            uint64_t record_us = pass_start_us + (uint32_t)(rec->hdr.timestamp - first);
+            if (record_us > micros())
+                native_advance_us(record_us - micros());
+
+            //Scripted devices only have one IN endpoint except for the wireless receiver,
+            //which uses the same endpoint numbers as the real one.
+            uint8_t ep = (rd->type == XBOX360_WIRELESS) ? rec->hdr.epAddr : native_devices[rd->type].in_ep & 0x7F;
+
+            //The capture may have started after a wireless pad connected.
+            uint8_t index;
+            if (rd->type == XBOX360_WIRELESS && find_pad(rd->addr, ep, &index) == NULL && rec->data[0] != 0x08)
+            {
+                poll_report(rd, ep, connected, sizeof(connected));
+            }
+
+            double parse_ns = poll_report(rd, ep, rec->data, rec->hdr.len);
+
+            usbh_xinput_t *xpad = find_pad(rd->addr, ep, &index);
+            replay_stat_t *s = &stats[(xpad) ? xpad->type : rd->type];
+            s->records++;
+            s->parse_ns += parse_ns;
+            total_ns += parse_ns;
+            if (xpad == NULL || index >= MAX_GAMEPADS)
+                continue;
+
+            auto start = std::chrono::steady_clock::now();
+            if (mode == DUKE)
+                handle_duke(xpad, &usbd_c[index].duke, &user_data[index]);
+            else
+                handle_sbattalion(xpad, &usbd_c[index].sb, &user_data[index]);
+            double map_ns = ns_since(start);
+            user_data[index].state_seq = xpad->state_seq;
+            s->mapped++;
+            s->map_ns += map_ns;
+            total_ns += map_ns;
+        }
+    }
+
+    printf("%-20s %10s %12s %12s %12s\n", "type", "records", "captured/s", "parse ns", "map ns");
+    for (uint8_t t = 0; t <= XINPUT_8BITDO_IDLE; t++)
+    {
+        replay_stat_t *s = &stats[t];
+        if (s->records == 0)
+            continue;
+        printf("%-20s %10u %12.1f %12.1f %12.1f\n", native_devices[t].name, s->records / passes,
+               duration_us ? (s->records / passes) * 1e6 / duration_us : 0.0,
+               s->parse_ns / s->records, s->mapped ? s->map_ns / s->mapped : 0.0);
+    }
+    printf("throughput: %.0f reports/s parsed and mapped (%.1f ns/report)\n",
+           records.size() * passes * 1e9 / total_ns, total_ns / (records.size() * passes));
+
+    return 0;
+}
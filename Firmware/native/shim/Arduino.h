@@ -0,0 +1,73 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//Minimal Arduino API for building the firmware translation core on a PC.
+//Only what the usbh/master sources touch is provided.
+
+#ifndef _NATIVE_ARDUINO_H_
+#define _NATIVE_ARDUINO_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define PROGMEM
+#define F(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_ptr(addr) (*(void *const *)(addr))
+#define memcpy_P memcpy
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define digitalPinToInterrupt(p) (p)
+#define DEC 10
+#define HEX 16
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t interruptNum, void (*userFunc)(void), int mode);
+
+//Native harness hook, millis()/micros() only move forward by this and delay()
+void native_advance_us(unsigned long us);
+//Native harness hook, runs the handler attached to an external interrupt
+void native_interrupt(uint8_t interruptNum);
+
+class HardwareSerial
+{
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    template <typename T> size_t print(T val) { (void)val; return 0; }
+    template <typename T> size_t print(T val, int base) { (void)val; (void)base; return 0; }
+    template <typename T> size_t println(T val) { (void)val; return 0; }
+    template <typename T> size_t println(T val, int base) { (void)val; (void)base; return 0; }
+    size_t println(void) { return 0; }
+    size_t write(uint8_t val) { (void)val; return 1; }
+    size_t write(const uint8_t *data, size_t len) { (void)data; return len; }
+};
+
+extern HardwareSerial Serial1;
+
+#endif
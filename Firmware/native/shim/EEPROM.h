@@ -0,0 +1,35 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _NATIVE_EEPROM_H_
+#define _NATIVE_EEPROM_H_
+
+#include <Arduino.h>
+
+//RAM backed EEPROM, erased (0xFF) at start up like a fresh ATmega32U4.
+class EEPROMClass
+{
+public:
+    EEPROMClass() { memset(mem, 0xFF, sizeof(mem)); }
+    uint8_t read(int idx) { return mem[idx]; }
+    void write(int idx, uint8_t val) { mem[idx] = val; }
+    void update(int idx, uint8_t val) { mem[idx] = val; }
+    uint16_t length() { return sizeof(mem); }
+    template <typename T> T &get(int idx, T &t)
+    {
+        memcpy(&t, &mem[idx], sizeof(T));
+        return t;
+    }
+    template <typename T> const T &put(int idx, const T &t)
+    {
+        memcpy(&mem[idx], &t, sizeof(T));
+        return t;
+    }
+
+private:
+    uint8_t mem[1024];
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,91 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//Just enough of the Arduino USB device core for usbd_xid.h to be included natively.
+
+#ifndef _NATIVE_PLUGGABLEUSB_H_
+#define _NATIVE_PLUGGABLEUSB_H_
+
+#include <Arduino.h>
+
+#define USB_EP_SIZE 64
+#define EP_TYPE_INTERRUPT_IN 0xC1
+#define EP_TYPE_INTERRUPT_OUT 0xC0
+
+typedef struct __attribute__((packed))
+{
+    uint8_t len;
+    uint8_t dtype;
+    uint16_t usbVersion;
+    uint8_t deviceClass;
+    uint8_t deviceSubClass;
+    uint8_t deviceProtocol;
+    uint8_t packetSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t deviceVersion;
+    uint8_t iManufacturer;
+    uint8_t iProduct;
+    uint8_t iSerialNumber;
+    uint8_t bNumConfigurations;
+} DeviceDescriptor;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t len;
+    uint8_t dtype;
+    uint8_t number;
+    uint8_t alternate;
+    uint8_t numEndpoints;
+    uint8_t interfaceClass;
+    uint8_t interfaceSubClass;
+    uint8_t protocol;
+    uint8_t iInterface;
+} InterfaceDescriptor;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t len;
+    uint8_t dtype;
+    uint8_t addr;
+    uint8_t attr;
+    uint16_t packetSize;
+    uint8_t interval;
+} EndpointDescriptor;
+
+typedef struct
+{
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint8_t wValueL;
+    uint8_t wValueH;
+    uint16_t wIndex;
+    uint16_t wLength;
+} USBSetup;
+
+#define D_DEVICE(_class, _subClass, _proto, _packetSize0, _vid, _pid, _version, _im, _ip, _is, _configs) \
+    { 18, 1, USB_VERSION, _class, _subClass, _proto, _packetSize0, _vid, _pid, _version, _im, _ip, _is, _configs }
+
+#ifndef USB_VERSION
+#define USB_VERSION 0x0110
+#endif
+
+class PluggableUSBModule
+{
+public:
+    PluggableUSBModule(uint8_t numEps, uint8_t numIfs, uint8_t *epType)
+        : numEndpoints(numEps), numInterfaces(numIfs), endpointType(epType) {}
+
+protected:
+    virtual bool setup(USBSetup &setup) = 0;
+    virtual int getInterface(uint8_t *interfaceCount) = 0;
+    virtual int getDescriptor(USBSetup &setup) = 0;
+
+    uint8_t pluggedInterface = 0;
+    uint8_t pluggedEndpoint = 1;
+    const uint8_t numEndpoints;
+    const uint8_t numInterfaces;
+    const uint8_t *endpointType;
+};
+
+#endif
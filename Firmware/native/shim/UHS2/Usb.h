@@ -0,0 +1,301 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//Native stand-in for the USB Host Shield 2.0 core. Instead of talking to a MAX3421E,
+//transfers are served from scripted devices so the xinput backend can run on a PC.
+
+#ifndef _NATIVE_UHS2_USB_H_
+#define _NATIVE_UHS2_USB_H_
+
+#include <Arduino.h>
+
+#define USB_NUMDEVICES 16
+#define USB_NATIVE_MAX_EP 16
+
+//Host result codes (MAX3421E HRSL)
+#define hrSUCCESS 0x00
+#define hrBUSY 0x01
+#define hrBADREQ 0x02
+#define hrUNDEF 0x03
+#define hrNAK 0x04
+#define hrSTALL 0x05
+#define hrTOGERR 0x06
+#define hrWRONGPID 0x07
+#define hrBADBC 0x08
+#define hrPIDERR 0x09
+#define hrPKTERR 0x0A
+#define hrCRCERR 0x0B
+#define hrKERR 0x0C
+#define hrJERR 0x0D
+#define hrTIMEOUT 0x0E
+#define hrBABBLE 0x0F
+
+//MAX3421E registers and bits used to drive the SIE directly (max3421e.h)
+#define rRCVFIFO 0x08
+#define rSNDFIFO 0x10
+#define rRCVBC 0x30
+#define rSNDBC 0x38
+#define rHIRQ 0xC8
+#define rHIEN 0xD0
+#define rMODE 0xD8
+#define rPERADDR 0xE0
+#define rHCTL 0xE8
+#define rHXFR 0xF0
+#define rHRSL 0xF8
+
+#define bmRCVDAVIRQ 0x04
+#define bmCONDETIRQ 0x20
+#define bmCONDETIE 0x20
+#define bmFRAMEIE 0x40
+#define bmHXFRDNIRQ 0x80
+#define bmLOWSPEED 0x02
+#define bmHUBPRE 0x04
+#define bmRCVTOG0 0x10
+#define bmRCVTOG1 0x20
+#define bmSNDTOG0 0x40
+#define bmSNDTOG1 0x80
+#define bmRCVTOGRD 0x10
+#define bmSNDTOGRD 0x20
+#define tokIN 0x00
+#define tokOUT 0x20
+
+#define USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED 0xD1
+#define USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE 0xD2
+#define USB_ERROR_UNABLE_TO_REGISTER_DEVICE_CLASS 0xD3
+#define USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL 0xD4
+#define USB_ERROR_HUB_ADDRESS_OVERFLOW 0xD5
+#define USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL 0xD6
+#define USB_ERROR_EPINFO_IS_NULL 0xD7
+#define USB_ERROR_INVALID_ARGUMENT 0xD8
+#define USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE 0xD9
+#define USB_ERROR_INVALID_MAX_PKT_SIZE 0xDA
+#define USB_ERROR_EP_NOT_FOUND_IN_TBL 0xDB
+#define USB_ERROR_TRANSFER_TIMEOUT 0xFF
+
+#define USB_NAK_MAX_POWER 15
+#define USB_NAK_DEFAULT 14
+#define USB_NAK_NOWAIT 1
+#define USB_NAK_NONAK 0
+
+#define USB_TRANSFER_TYPE_CONTROL 0x00
+#define USB_TRANSFER_TYPE_ISOCHRONOUS 0x01
+#define USB_TRANSFER_TYPE_BULK 0x02
+#define USB_TRANSFER_TYPE_INTERRUPT 0x03
+
+#define USB_DESCRIPTOR_DEVICE 0x01
+#define USB_DESCRIPTOR_CONFIGURATION 0x02
+#define USB_DESCRIPTOR_STRING 0x03
+#define USB_DESCRIPTOR_INTERFACE 0x04
+#define USB_DESCRIPTOR_ENDPOINT 0x05
+#define USB_ENDPOINT_DESCRIPTOR_TYPE USB_DESCRIPTOR_ENDPOINT
+
+#define USB_CLASS_HID 0x03
+#define USB_CLASS_HUB 0x09
+
+#define USB_REQUEST_GET_DESCRIPTOR 6
+#define USB_REQUEST_SET_ADDRESS 5
+#define USB_REQUEST_SET_CONFIGURATION 9
+#define bmREQ_GET_DESCR 0x80
+#define bmREQ_SET 0x00
+
+#define USB_STATE_RUNNING 0x90
+
+typedef struct __attribute__((packed))
+{
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bMaxPacketSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t iManufacturer;
+    uint8_t iProduct;
+    uint8_t iSerialNumber;
+    uint8_t bNumConfigurations;
+} USB_DEVICE_DESCRIPTOR;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t wTotalLength;
+    uint8_t bNumInterfaces;
+    uint8_t bConfigurationValue;
+    uint8_t iConfiguration;
+    uint8_t bmAttributes;
+    uint8_t bMaxPower;
+} USB_CONFIGURATION_DESCRIPTOR;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bNumEndpoints;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t iInterface;
+} USB_INTERFACE_DESCRIPTOR;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bEndpointAddress;
+    uint8_t bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t bInterval;
+} USB_ENDPOINT_DESCRIPTOR;
+
+struct EpInfo
+{
+    uint8_t epAddr;
+    uint8_t maxPktSize;
+    uint8_t dir;
+    union
+    {
+        uint8_t epAttribs;
+        struct
+        {
+            uint8_t bmSndToggle : 1;
+            uint8_t bmRcvToggle : 1;
+            uint8_t bmNakPower : 6;
+        } __attribute__((packed));
+    };
+} __attribute__((packed));
+
+struct UsbDevice
+{
+    EpInfo *epinfo;
+    uint8_t address;
+    uint8_t epcount;
+    bool lowspeed;
+    uint8_t devclass;
+};
+
+class AddressPool
+{
+public:
+    AddressPool() { memset(devs, 0, sizeof(devs)); }
+    UsbDevice *GetUsbDevicePtr(uint8_t addr)
+    {
+        return (addr && addr < USB_NUMDEVICES && devs[addr].address) ? &devs[addr] : NULL;
+    }
+    uint8_t AllocAddress(uint8_t parent, bool is_hub = false, uint8_t port = 0)
+    {
+        (void)parent, (void)is_hub, (void)port;
+        for (uint8_t i = 1; i < USB_NUMDEVICES; i++)
+        {
+            if (devs[i].address == 0)
+            {
+                memset(&devs[i], 0, sizeof(UsbDevice));
+                devs[i].address = i;
+                return i;
+            }
+        }
+        return 0;
+    }
+    void FreeAddress(uint8_t addr)
+    {
+        if (addr && addr < USB_NUMDEVICES)
+            memset(&devs[addr], 0, sizeof(UsbDevice));
+    }
+
+private:
+    UsbDevice devs[USB_NUMDEVICES];
+};
+
+class USBReadParser
+{
+public:
+    virtual void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset) = 0;
+};
+
+class USBDeviceConfig
+{
+public:
+    virtual uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed, USB_DEVICE_DESCRIPTOR *udd)
+    {
+        (void)parent, (void)port, (void)lowspeed, (void)udd;
+        return 0;
+    }
+    virtual uint8_t Release() { return 0; }
+    virtual uint8_t Poll() { return 0; }
+    virtual uint8_t GetAddress() { return 0; }
+    virtual void ResetHubPort(uint8_t port) { (void)port; }
+    virtual bool VIDPIDOK(uint16_t vid, uint16_t pid) { (void)vid, (void)pid; return false; }
+    virtual bool DEVCLASSOK(uint8_t klass) { (void)klass; return false; }
+    virtual bool DEVSUBCLASSOK(uint8_t subklass) { (void)subklass; return true; }
+};
+
+//A scripted device. Descriptors are served on the control pipe, IN reports
+//are served from per endpoint slots that the harness fills.
+typedef struct
+{
+    const uint8_t *dev_desc;
+    const uint8_t *conf_desc;
+    uint16_t conf_len;
+    const uint8_t *str_desc;
+    const uint8_t *in_report[USB_NATIVE_MAX_EP];
+    uint16_t in_len[USB_NATIVE_MAX_EP];
+    bool in_repeat[USB_NATIVE_MAX_EP];
+} usb_native_device_t;
+
+class USB
+{
+public:
+    USB(void);
+    uint8_t Init(void) { return 0; }
+    void Task(void);
+    uint8_t IntHandler(void) { return 0; }
+    void busprobe(void) {}
+    uint8_t getUsbTaskState(void) { return USB_STATE_RUNNING; }
+
+    AddressPool &GetAddressPool(void) { return addrPool; }
+    uint8_t RegisterDeviceClass(USBDeviceConfig *pdev);
+    uint8_t setEpInfoEntry(uint8_t addr, uint8_t epcount, EpInfo *eprecord_ptr);
+
+    uint8_t ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
+                    uint16_t wInd, uint16_t total, uint16_t nbytes, uint8_t *dataptr, USBReadParser *p);
+    uint8_t getDevDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t *dataptr);
+    uint8_t getConfDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t conf, uint8_t *dataptr);
+    uint8_t getStrDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t index, uint16_t langid, uint8_t *dataptr);
+    uint8_t setAddr(uint8_t oldaddr, uint8_t ep, uint8_t newaddr);
+    uint8_t setConf(uint8_t addr, uint8_t ep, uint8_t conf_value);
+    uint8_t inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t *data, uint8_t bInterval = 0);
+    uint8_t outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t *data);
+
+    //MAX3421E register access. A write to HXFR runs the transaction against the scripted
+    //device straight away and raises HXFRDN, HIRQ bits are cleared by writing a 1.
+    void regWr(uint8_t reg, uint8_t data);
+    uint8_t regRd(uint8_t reg);
+    uint8_t *bytesWr(uint8_t reg, uint8_t nbytes, uint8_t *data_p);
+    uint8_t *bytesRd(uint8_t reg, uint8_t nbytes, uint8_t *data_p);
+
+    //Native harness hooks
+    USBDeviceConfig *native_attach(usb_native_device_t *dev, uint8_t port);
+    void native_detach(uint8_t addr);
+    usb_native_device_t *native_device(uint8_t addr);
+    void native_set_report(uint8_t addr, uint8_t ep, const uint8_t *data, uint16_t len, bool repeat);
+
+    uint32_t native_in_transfers;
+    uint32_t native_out_transfers;
+    uint32_t native_ctrl_transfers;
+
+private:
+    AddressPool addrPool;
+    USBDeviceConfig *devConfig[USB_NUMDEVICES];
+    usb_native_device_t *native_devs[USB_NUMDEVICES];
+    usb_native_device_t *native_pending;
+    uint8_t native_regs[32];
+    uint8_t native_rcvfifo[64];
+    uint8_t native_sndfifo[64];
+};
+
+#endif
@@ -0,0 +1,16 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _NATIVE_UHS2_USBHID_H_
+#define _NATIVE_UHS2_USBHID_H_
+
+#include <UHS2/Usb.h>
+
+#define HID_REQUEST_SET_PROTOCOL 0x0B
+#define USB_HID_BOOT_PROTOCOL 0x00
+#define USB_HID_PROTOCOL_NONE 0x00
+#define USB_HID_PROTOCOL_KEYBOARD 0x01
+#define USB_HID_PROTOCOL_MOUSE 0x02
+#define bmREQ_HID_OUT 0x21
+
+#endif
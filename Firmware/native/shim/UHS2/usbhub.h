@@ -0,0 +1,28 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _NATIVE_UHS2_USBHUB_H_
+#define _NATIVE_UHS2_USBHUB_H_
+
+#include <UHS2/Usb.h>
+
+//Hubs are never attached natively, the driver just occupies a class slot like on hardware.
+class USBHub : public USBDeviceConfig
+{
+public:
+    USBHub(USB *p)
+    {
+        if (p)
+            p->RegisterDeviceClass(this);
+    }
+    uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed, USB_DEVICE_DESCRIPTOR *udd)
+    {
+        (void)parent, (void)port, (void)lowspeed, (void)udd;
+        return USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+    }
+
+private:
+    EpInfo epInfo[2];
+};
+
+#endif
@@ -0,0 +1,69 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _NATIVE_WIRE_H_
+#define _NATIVE_WIRE_H_
+
+#include <Arduino.h>
+
+#define WIRE_BUFFER_LENGTH 32
+#define TWI_MAX_ADDRESS 128
+
+class TwoWire;
+
+typedef struct
+{
+    uint32_t transactions;
+    uint32_t nacks;
+    uint32_t bytes;
+    uint64_t bus_ns;
+    uint64_t last_write_done_ns; //Bus time the last master write to this address completed
+} twi_node_stats_t;
+
+//Every TwoWire instance shares one simulated bus. Slaves attach with begin(address) and their
+//onReceive/onRequest callbacks run inside the master's transfer, like the TWI ISR would.
+//Bus time is modelled per bit: START + 9 bits per byte (address included) + STOP at the set clock.
+typedef struct
+{
+    TwoWire *slaves[TWI_MAX_ADDRESS];
+    uint32_t clock;
+    uint64_t bus_ns;
+    twi_node_stats_t node[TWI_MAX_ADDRESS];
+} twi_bus_t;
+
+extern twi_bus_t twi_bus;
+
+class TwoWire
+{
+public:
+    void begin(void);
+    void begin(uint8_t address);
+    void setClock(uint32_t clock);
+    void setWireTimeout(uint32_t timeout, bool reset_with_timeout) { (void)timeout; (void)reset_with_timeout; }
+    void beginTransmission(uint8_t address);
+    void beginTransmission(int address) { beginTransmission((uint8_t)address); }
+    uint8_t endTransmission(uint8_t sendStop);
+    uint8_t endTransmission(void) { return endTransmission(true); }
+    uint8_t requestFrom(int address, int quantity);
+    size_t write(uint8_t data);
+    size_t write(const uint8_t *data, size_t len);
+    size_t write(const char *data, size_t len) { return write((const uint8_t *)data, len); }
+    int available(void) { return rx_len - rx_pos; }
+    int read(void) { return (rx_pos < rx_len) ? rx_buf[rx_pos++] : -1; }
+    void onReceive(void (*function)(int)) { user_onReceive = function; }
+    void onRequest(void (*function)(void)) { user_onRequest = function; }
+
+private:
+    uint8_t tx_address = 0;
+    uint8_t tx_buf[WIRE_BUFFER_LENGTH];
+    uint8_t tx_len = 0;
+    uint8_t rx_buf[WIRE_BUFFER_LENGTH];
+    uint8_t rx_len = 0;
+    uint8_t rx_pos = 0;
+    void (*user_onReceive)(int) = NULL;
+    void (*user_onRequest)(void) = NULL;
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,350 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <UHS2/Usb.h>
+
+HardwareSerial Serial1;
+EEPROMClass EEPROM;
+
+//Time only moves when the harness advances it (or firmware code calls delay), so runs are
+//repeatable and the USB host endpoint schedule sees the frame times the harness asks for.
+static uint64_t native_clock_us;
+
+void native_advance_us(unsigned long us)
+{
+    native_clock_us += us;
+}
+
+unsigned long millis(void)
+{
+    return native_clock_us / 1000;
+}
+
+unsigned long micros(void)
+{
+    return native_clock_us;
+}
+
+void delay(unsigned long ms)
+{
+    native_clock_us += ms * 1000ULL;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    native_clock_us += us;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    (void)pin, (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+    (void)pin, (void)val;
+}
+
+int digitalRead(uint8_t pin)
+{
+    (void)pin;
+    return HIGH;
+}
+
+static void (*native_isr[32])(void);
+
+void attachInterrupt(uint8_t interruptNum, void (*userFunc)(void), int mode)
+{
+    (void)mode;
+    if (interruptNum < 32)
+        native_isr[interruptNum] = userFunc;
+}
+
+void native_interrupt(uint8_t interruptNum)
+{
+    if (interruptNum < 32 && native_isr[interruptNum])
+        native_isr[interruptNum]();
+}
+
+USB::USB(void) : native_in_transfers(0), native_out_transfers(0), native_ctrl_transfers(0), native_pending(NULL)
+{
+    memset(devConfig, 0, sizeof(devConfig));
+    memset(native_devs, 0, sizeof(native_devs));
+    memset(native_regs, 0, sizeof(native_regs));
+}
+
+void USB::Task(void)
+{
+    for (uint8_t i = 0; i < USB_NUMDEVICES; i++)
+    {
+        if (devConfig[i])
+            devConfig[i]->Poll();
+    }
+}
+
+uint8_t USB::RegisterDeviceClass(USBDeviceConfig *pdev)
+{
+    for (uint8_t i = 0; i < USB_NUMDEVICES; i++)
+    {
+        if (devConfig[i] == NULL)
+        {
+            devConfig[i] = pdev;
+            return 0;
+        }
+    }
+    return USB_ERROR_UNABLE_TO_REGISTER_DEVICE_CLASS;
+}
+
+uint8_t USB::setEpInfoEntry(uint8_t addr, uint8_t epcount, EpInfo *eprecord_ptr)
+{
+    if (!eprecord_ptr)
+        return USB_ERROR_EPINFO_IS_NULL;
+
+    UsbDevice *p = addrPool.GetUsbDevicePtr(addr);
+    if (addr && !p)
+        return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+
+    if (p)
+    {
+        p->epinfo = eprecord_ptr;
+        p->epcount = epcount;
+    }
+    return 0;
+}
+
+usb_native_device_t *USB::native_device(uint8_t addr)
+{
+    if (addr == 0)
+        return native_pending;
+    return (addr < USB_NUMDEVICES) ? native_devs[addr] : NULL;
+}
+
+uint8_t USB::ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
+                     uint16_t wInd, uint16_t total, uint16_t nbytes, uint8_t *dataptr, USBReadParser *p)
+{
+    (void)ep, (void)wInd;
+    native_ctrl_transfers++;
+
+    usb_native_device_t *dev = native_device(addr);
+    if (dev == NULL)
+        return hrTIMEOUT;
+
+    if (bmReqType == bmREQ_SET && bRequest == USB_REQUEST_SET_ADDRESS)
+    {
+        if (wValLo >= USB_NUMDEVICES)
+            return hrSTALL;
+        native_devs[wValLo] = dev;
+        return hrSUCCESS;
+    }
+
+    if (bmReqType != bmREQ_GET_DESCR || bRequest != USB_REQUEST_GET_DESCRIPTOR)
+        return hrSUCCESS;
+
+    const uint8_t *src = NULL;
+    uint16_t src_len = 0;
+    if (wValHi == USB_DESCRIPTOR_DEVICE)
+    {
+        src = dev->dev_desc;
+        src_len = sizeof(USB_DEVICE_DESCRIPTOR);
+    }
+    else if (wValHi == USB_DESCRIPTOR_CONFIGURATION)
+    {
+        src = dev->conf_desc;
+        src_len = dev->conf_len;
+    }
+    else if (wValHi == USB_DESCRIPTOR_STRING && dev->str_desc)
+    {
+        src = dev->str_desc;
+        src_len = dev->str_desc[0];
+    }
+
+    if (src == NULL)
+        return hrSTALL;
+
+    uint16_t len = min(total, src_len);
+    if (p == NULL)
+    {
+        memcpy(dataptr, src, len);
+        return hrSUCCESS;
+    }
+
+    //Stream it to the parser one packet at a time, like the real control pipe does.
+    for (uint16_t offset = 0; offset < len; offset += nbytes)
+    {
+        uint16_t chunk = min((uint16_t)(len - offset), nbytes);
+        memcpy(dataptr, &src[offset], chunk);
+        p->Parse(chunk, dataptr, offset);
+    }
+    return hrSUCCESS;
+}
+
+uint8_t USB::getDevDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t *dataptr)
+{
+    return ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, 0x00, USB_DESCRIPTOR_DEVICE, 0x0000, nbytes, nbytes, dataptr, NULL);
+}
+
+uint8_t USB::getConfDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t conf, uint8_t *dataptr)
+{
+    return ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, conf, USB_DESCRIPTOR_CONFIGURATION, 0x0000, nbytes, nbytes, dataptr, NULL);
+}
+
+uint8_t USB::getStrDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t index, uint16_t langid, uint8_t *dataptr)
+{
+    return ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, index, USB_DESCRIPTOR_STRING, langid, nbytes, nbytes, dataptr, NULL);
+}
+
+uint8_t USB::setAddr(uint8_t oldaddr, uint8_t ep, uint8_t newaddr)
+{
+    return ctrlReq(oldaddr, ep, bmREQ_SET, USB_REQUEST_SET_ADDRESS, newaddr, 0x00, 0x0000, 0x0000, 0x0000, NULL, NULL);
+}
+
+uint8_t USB::setConf(uint8_t addr, uint8_t ep, uint8_t conf_value)
+{
+    return ctrlReq(addr, ep, bmREQ_SET, USB_REQUEST_SET_CONFIGURATION, conf_value, 0x00, 0x0000, 0x0000, 0x0000, NULL, NULL);
+}
+
+uint8_t USB::inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t *data, uint8_t bInterval)
+{
+    (void)bInterval;
+    native_in_transfers++;
+
+    usb_native_device_t *dev = native_device(addr);
+    if (dev == NULL || addr == 0)
+        return hrTIMEOUT;
+
+    ep &= 0x7F;
+    if (ep >= USB_NATIVE_MAX_EP || dev->in_report[ep] == NULL)
+        return hrNAK;
+
+    uint16_t len = min(*nbytesptr, dev->in_len[ep]);
+    memcpy(data, dev->in_report[ep], len);
+    *nbytesptr = len;
+    if (!dev->in_repeat[ep])
+        dev->in_report[ep] = NULL;
+    return hrSUCCESS;
+}
+
+uint8_t USB::outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t *data)
+{
+    (void)ep, (void)nbytes, (void)data;
+    native_out_transfers++;
+    return (native_device(addr) == NULL) ? hrTIMEOUT : hrSUCCESS;
+}
+
+void USB::regWr(uint8_t reg, uint8_t data)
+{
+    uint8_t *r = &native_regs[reg >> 3];
+    if (reg == rHIRQ)
+    {
+        *r &= ~data;
+        return;
+    }
+    if (reg == rHCTL)
+    {
+        uint8_t *hrsl = &native_regs[rHRSL >> 3];
+        if (data & bmRCVTOG0)
+            *hrsl &= ~bmRCVTOGRD;
+        if (data & bmRCVTOG1)
+            *hrsl |= bmRCVTOGRD;
+        if (data & bmSNDTOG0)
+            *hrsl &= ~bmSNDTOGRD;
+        if (data & bmSNDTOG1)
+            *hrsl |= bmSNDTOGRD;
+        return;
+    }
+    *r = data;
+    if (reg != rHXFR)
+        return;
+
+    uint8_t addr = native_regs[rPERADDR >> 3];
+    uint8_t ep = data & 0x0F;
+    uint8_t *hrsl = &native_regs[rHRSL >> 3];
+    uint8_t rcode;
+    if ((data & 0xF0) == tokOUT)
+    {
+        rcode = outTransfer(addr, ep, native_regs[rSNDBC >> 3], native_sndfifo);
+        if (rcode == hrSUCCESS)
+            *hrsl ^= bmSNDTOGRD;
+    }
+    else
+    {
+        uint16_t len = sizeof(native_rcvfifo);
+        rcode = inTransfer(addr, ep, &len, native_rcvfifo);
+        if (rcode == hrSUCCESS)
+        {
+            *hrsl ^= bmRCVTOGRD;
+            native_regs[rRCVBC >> 3] = len;
+            native_regs[rHIRQ >> 3] |= bmRCVDAVIRQ;
+        }
+    }
+    *hrsl = (*hrsl & 0xF0) | rcode;
+    native_regs[rHIRQ >> 3] |= bmHXFRDNIRQ;
+}
+
+uint8_t USB::regRd(uint8_t reg)
+{
+    return native_regs[reg >> 3];
+}
+
+uint8_t *USB::bytesWr(uint8_t reg, uint8_t nbytes, uint8_t *data_p)
+{
+    if (reg == rSNDFIFO)
+        memcpy(native_sndfifo, data_p, min(nbytes, (uint8_t)sizeof(native_sndfifo)));
+    return data_p + nbytes;
+}
+
+uint8_t *USB::bytesRd(uint8_t reg, uint8_t nbytes, uint8_t *data_p)
+{
+    if (reg == rRCVFIFO)
+        memcpy(data_p, native_rcvfifo, min(nbytes, (uint8_t)sizeof(native_rcvfifo)));
+    return data_p + nbytes;
+}
+
+USBDeviceConfig *USB::native_attach(usb_native_device_t *dev, uint8_t port)
+{
+    USB_DEVICE_DESCRIPTOR udd;
+    memcpy(&udd, dev->dev_desc, sizeof(udd));
+    native_pending = dev;
+
+    for (uint8_t i = 0; i < USB_NUMDEVICES; i++)
+    {
+        //Consumed instances are skipped, like USB::Configuring() does
+        if (devConfig[i] == NULL || devConfig[i]->GetAddress())
+            continue;
+
+        uint8_t rcode = devConfig[i]->Init(0, port, false, &udd);
+        if (rcode == hrSUCCESS)
+        {
+            native_pending = NULL;
+            return devConfig[i];
+        }
+        if (rcode != USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED && rcode != USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE)
+            break;
+    }
+    native_pending = NULL;
+    return NULL;
+}
+
+void USB::native_detach(uint8_t addr)
+{
+    for (uint8_t i = 0; i < USB_NUMDEVICES; i++)
+    {
+        if (devConfig[i] && devConfig[i]->GetAddress() == addr)
+            devConfig[i]->Release();
+    }
+    if (addr < USB_NUMDEVICES)
+        native_devs[addr] = NULL;
+}
+
+void USB::native_set_report(uint8_t addr, uint8_t ep, const uint8_t *data, uint16_t len, bool repeat)
+{
+    usb_native_device_t *dev = native_device(addr);
+    ep &= 0x7F;
+    if (dev == NULL || ep >= USB_NATIVE_MAX_EP)
+        return;
+    dev->in_report[ep] = data;
+    dev->in_len[ep] = len;
+    dev->in_repeat[ep] = repeat;
+}
@@ -0,0 +1,105 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <Wire.h>
+
+twi_bus_t twi_bus = {{NULL}, 100000, 0, {}};
+TwoWire Wire;
+
+static uint64_t twi_bus_time(uint8_t address, uint8_t bytes)
+{
+    //START, address byte, data bytes (8 bits + ACK each) and STOP
+    uint32_t bits = 1 + 9 * (1 + bytes) + 1;
+    uint64_t ns = (uint64_t)bits * 1000000000ULL / twi_bus.clock;
+    twi_bus.bus_ns += ns;
+    twi_bus.node[address].transactions++;
+    twi_bus.node[address].bytes += bytes;
+    twi_bus.node[address].bus_ns += ns;
+    return ns;
+}
+
+void TwoWire::begin(void)
+{
+}
+
+void TwoWire::begin(uint8_t address)
+{
+    if (address < TWI_MAX_ADDRESS)
+        twi_bus.slaves[address] = this;
+}
+
+void TwoWire::setClock(uint32_t clock)
+{
+    twi_bus.clock = clock;
+}
+
+void TwoWire::beginTransmission(uint8_t address)
+{
+    tx_address = address & (TWI_MAX_ADDRESS - 1);
+    tx_len = 0;
+}
+
+uint8_t TwoWire::endTransmission(uint8_t sendStop)
+{
+    (void)sendStop;
+    TwoWire *slave = twi_bus.slaves[tx_address];
+    if (slave == NULL)
+    {
+        twi_bus_time(tx_address, 0);
+        twi_bus.node[tx_address].nacks++;
+        return 2;
+    }
+
+    memcpy(slave->rx_buf, tx_buf, tx_len);
+    slave->rx_len = tx_len;
+    slave->rx_pos = 0;
+    twi_bus_time(tx_address, tx_len);
+    twi_bus.node[tx_address].last_write_done_ns = twi_bus.bus_ns;
+    if (slave->user_onReceive)
+        slave->user_onReceive(tx_len);
+    tx_len = 0;
+    return 0;
+}
+
+uint8_t TwoWire::requestFrom(int address, int quantity)
+{
+    uint8_t addr = address & (TWI_MAX_ADDRESS - 1);
+    uint8_t len = min(quantity, WIRE_BUFFER_LENGTH);
+    TwoWire *slave = twi_bus.slaves[addr];
+    rx_len = 0;
+    rx_pos = 0;
+    if (slave == NULL)
+    {
+        twi_bus_time(addr, 0);
+        twi_bus.node[addr].nacks++;
+        return 0;
+    }
+
+    slave->tx_len = 0;
+    if (slave->user_onRequest)
+        slave->user_onRequest();
+
+    //The master clocks out what it asked for, a slave that runs out of data leaves the bus high.
+    memset(rx_buf, 0xFF, len);
+    memcpy(rx_buf, slave->tx_buf, min(slave->tx_len, len));
+    rx_len = len;
+    slave->tx_len = 0;
+    twi_bus_time(addr, len);
+    return rx_len;
+}
+
+size_t TwoWire::write(uint8_t data)
+{
+    if (tx_len >= WIRE_BUFFER_LENGTH)
+        return 0;
+    tx_buf[tx_len++] = data;
+    return 1;
+}
+
+size_t TwoWire::write(const uint8_t *data, size_t len)
+{
+    size_t n = 0;
+    while (n < len && write(data[n]))
+        n++;
+    return n;
+}
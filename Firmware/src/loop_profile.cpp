@@ -0,0 +1,138 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifdef ENABLE_LOOP_PROFILE
+
+#include <Arduino.h>
+
+#include "main.h"
+
+//Cycle accurate master_task() timing. Timer1 free runs at F_CPU and its overflows extend it to 32 bits.
+//Every LOOP_PROFILE_WINDOW iterations min/avg/p99/max cycles are printed on Serial1.
+//p99 is exact: the LOOP_PROFILE_TOP largest samples of the window are kept, the smallest of those is p99.
+#ifndef LOOP_PROFILE_WINDOW
+#define LOOP_PROFILE_WINDOW 1000
+#endif
+#define LOOP_PROFILE_TOP (LOOP_PROFILE_WINDOW / 100 + 1)
+
+extern usbd_controller_t usbd_c[MAX_GAMEPADS];
+
+static volatile uint16_t timer1_overflows;
+static uint32_t start_cycles;
+
+static struct
+{
+    uint8_t players;
+    uint8_t mode;
+    uint16_t count;
+    uint32_t min;
+    uint32_t max;
+    uint32_t sum;
+    uint32_t top[LOOP_PROFILE_TOP];
+} window;
+
+ISR(TIMER1_OVF_vect)
+{
+    timer1_overflows++;
+}
+
+static uint32_t read_cycles(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t ovf = timer1_overflows;
+    uint16_t tcnt = TCNT1;
+    //Overflow happened but the ISR hasn't run yet
+    if ((TIFR1 & (1 << TOV1)) && tcnt < 0x8000)
+        ovf++;
+    SREG = sreg;
+    return ((uint32_t)ovf << 16) | tcnt;
+}
+
+static void reset_window(uint8_t players, uint8_t mode)
+{
+    memset(&window, 0x00, sizeof(window));
+    window.players = players;
+    window.mode = mode;
+    window.min = UINT32_MAX;
+}
+
+void loop_profile_init(void)
+{
+    //Normal mode, no prescaler.
+    TCCR1A = 0;
+    TCCR1B = (1 << CS10);
+    TCNT1 = 0;
+    TIFR1 = (1 << TOV1);
+    TIMSK1 = (1 << TOIE1);
+    reset_window(0, 0);
+}
+
+void loop_profile_start(void)
+{
+    start_cycles = read_cycles();
+}
+
+void loop_profile_stop(void)
+{
+    uint32_t cycles = read_cycles() - start_cycles;
+
+    //Samples are grouped by connected players and the modes they are in.
+    uint8_t players = 0, mode = 0;
+    usbh_xinput_t *usbh_head = usbh_xinput_get_device_list();
+    for (uint8_t i = 0; i < MAX_GAMEPADS; i++)
+    {
+        if (usbh_head[i].bAddress == 0)
+            continue;
+        players++;
+        mode |= 1 << usbd_c[i].type;
+    }
+
+    //Different setup, don't mix the samples.
+    if (players != window.players || mode != window.mode)
+    {
+        reset_window(players, mode);
+    }
+
+    window.sum += cycles;
+    if (cycles < window.min) window.min = cycles;
+    if (cycles > window.max) window.max = cycles;
+
+    //Keep the largest samples sorted descending, drop the smallest.
+    for (uint8_t i = 0; i < LOOP_PROFILE_TOP; i++)
+    {
+        if (cycles > window.top[i])
+        {
+            uint32_t tmp = window.top[i];
+            window.top[i] = cycles;
+            cycles = tmp;
+        }
+    }
+
+    if (++window.count < LOOP_PROFILE_WINDOW)
+    {
+        return;
+    }
+
+    Serial1.print(F("LOOP players="));
+    Serial1.print(window.players);
+    Serial1.print(F(" mode="));
+    Serial1.print((window.mode == (1 << STEELBATTALION)) ? F("SB") :
+                  (window.mode == (1 << DUKE)) ? F("DUKE") :
+                  (window.mode == 0) ? F("NONE") : F("MIXED"));
+    Serial1.print(F(" cycles min="));
+    Serial1.print(window.min);
+    Serial1.print(F(" avg="));
+    Serial1.print(window.sum / window.count);
+    Serial1.print(F(" p99="));
+    Serial1.print(window.top[LOOP_PROFILE_TOP - 1]);
+    Serial1.print(F(" max="));
+    Serial1.print(window.max);
+    Serial1.print(F(" (avg us="));
+    Serial1.print(window.sum / window.count / (F_CPU / 1000000UL));
+    Serial1.println(F(")"));
+
+    reset_window(players, mode);
+}
+
+#endif
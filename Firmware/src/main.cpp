@@ -13,7 +13,7 @@ usbd_controller_t usbd_c[MAX_GAMEPADS];
 
 void setup()
 {
-    Serial1.begin(115200);
+    Serial1.begin(SERIAL1_BAUD);
 
     pinMode(ARDUINO_LED_PIN, OUTPUT);
     pinMode(PLAYER_ID1_PIN, INPUT_PULLUP);
@@ -25,6 +25,7 @@ void setup()
     for (uint8_t i = 0; i < MAX_GAMEPADS; i++)
     {
         usbd_c[i].type = DUKE;
+        usbd_c[i].interval = XID_INTERVAL_MS;
         usbd_c[i].duke.in.bLength = sizeof(usbd_duke_in_t);
         usbd_c[i].duke.out.bLength = sizeof(usbd_duke_out_t);
 
@@ -41,6 +42,9 @@ void setup()
     if (player_id == 0)
     {
         master_init();
+#ifdef ENABLE_LOOP_PROFILE
+        loop_profile_init();
+#endif
     }
     else
     {
@@ -50,25 +54,18 @@ void setup()
 
 void loop()
 {
-#if (0)
-    //Performance loop timing.
-    //Four slaves, four wireless controllers is about 4000us per loop
-    //Perfect!
-    static uint32_t loop_cnt = 0;
-    static uint32_t loop_timer = 0;
-    if (loop_cnt > 1000)
-    {
-        Serial1.print("Loop time: (us) ");
-        Serial1.println(millis() - loop_timer);
-        loop_cnt = 0;
-        loop_timer = millis();
-    }
-    loop_cnt++;
-#endif
-
     if (player_id == 0)
     {
+#ifdef ENABLE_LOOP_PROFILE
+        loop_profile_start();
+        master_task();
+        loop_profile_stop();
+#else
         master_task();
+#endif
+#ifdef ENABLE_USBH_XINPUT_STATS
+        xinput_stats_task();
+#endif
     }
     else
     {
@@ -80,30 +77,28 @@ void loop()
     {
         usbd_xid.setType(usbd_c[0].type);
     }
-
-    static uint32_t poll_timer = 0;
-    if (millis() - poll_timer > 4)
+    if (usbd_xid.getInterval() != usbd_c[0].interval)
     {
-        if (usbd_xid.getType() == DUKE)
-        {
-            UDCON &= ~(1 << DETACH);
-            RXLED1;
-            usbd_xid.sendReport(&usbd_c[0].duke.in, sizeof(usbd_duke_in_t));
-            usbd_xid.getReport(&usbd_c[0].duke.out, sizeof(usbd_duke_out_t));
-        }
-        else if (usbd_xid.getType() == STEELBATTALION)
-        {
-            UDCON &= ~(1 << DETACH);
-            RXLED1;
-            usbd_xid.sendReport(&usbd_c[0].sb.in, sizeof(usbd_sbattalion_in_t));
-            usbd_xid.getReport(&usbd_c[0].sb.out, sizeof(usbd_sbattalion_out_t));
-        }
-        else if (usbd_xid.getType() == DISCONNECTED)
-        {
-            UDCON |= (1 << DETACH);
-            RXLED0;
-        }
+        usbd_xid.setInterval(usbd_c[0].interval);
+    }
 
-        poll_timer = millis();
+    //A new input state goes out in the same loop it was mapped, replacing a report the console hasn't
+    //read yet. The console polling the IN endpoint every usbd_c[0].interval ms is the only cadence.
+    if (!usbd_xid.task())
+    {
+        //Off the bus, no controller or a type or interval change is being picked up by the console
+        RXLED0;
+    }
+    else if (usbd_xid.getType() == DUKE)
+    {
+        RXLED1;
+        usbd_xid.sendReport(&usbd_c[0].duke.in, sizeof(usbd_duke_in_t));
+        usbd_xid.getReport(&usbd_c[0].duke.out, sizeof(usbd_duke_out_t));
+    }
+    else if (usbd_xid.getType() == STEELBATTALION)
+    {
+        RXLED1;
+        usbd_xid.sendReport(&usbd_c[0].sb.in, sizeof(usbd_sbattalion_in_t));
+        usbd_xid.getReport(&usbd_c[0].sb.out, sizeof(usbd_sbattalion_out_t));
     }
 }
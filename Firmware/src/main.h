@@ -11,11 +11,26 @@
 #define MAX_GAMEPADS 4
 #endif
 
+//Hub driver instances, one per hub (including the hub inside a multi port receiver or adapter)
+#ifndef USBH_MAX_HUBS
+#define USBH_MAX_HUBS 5
+#endif
+
 #define USB_HOST_RESET_PIN 9
+#define USB_HOST_INT_PIN 7 //MAX3421E INT, INT6 on the ATmega32U4
 #define ARDUINO_LED_PIN 17
 #define PLAYER_ID1_PIN 19
 #define PLAYER_ID2_PIN 20
 
+#ifndef SERIAL1_BAUD
+#define SERIAL1_BAUD 115200
+#endif
+
+//Max time between input reports sent to a slave when nothing changed
+#ifndef SLAVE_REFRESH_MS
+#define SLAVE_REFRESH_MS 100
+#endif
+
 #ifndef SB_DEFAULT_SENSITIVITY
 #define SB_DEFAULT_SENSITIVITY 400
 #endif
@@ -23,6 +38,7 @@
 typedef struct
 {
    xid_type_t type;
+   uint8_t interval; //XID endpoint bInterval in ms, see XID_INTERVAL_MS
    usbd_duke_t duke;
    usbd_steelbattalion_t sb;
 } usbd_controller_t;
@@ -32,4 +48,14 @@ void master_task();
 void slave_init();
 void slave_task();
 
+#ifdef ENABLE_LOOP_PROFILE
+void loop_profile_init();
+void loop_profile_start();
+void loop_profile_stop();
+#endif
+
+#ifdef ENABLE_USBH_XINPUT_STATS
+void xinput_stats_task();
+#endif
+
 #endif 
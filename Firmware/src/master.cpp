@@ -9,16 +9,29 @@
 
 #include "main.h"
 
+#if USBH_MAX_HUBS + XINPUT_MAX_DEVICES > USB_NUMDEVICES
+#error "USBH_MAX_HUBS + XINPUT_MAX_DEVICES driver instances don't fit in USB_NUMDEVICES"
+#endif
+
+//N driver instances, constructed and registered with the host in order. An empty pool takes no
+//driver slots, so a build without hub support just sets USBH_MAX_HUBS to 0.
+template <class T, uint8_t N>
+struct usbh_pool
+{
+    T dev;
+    usbh_pool<T, N - 1> next;
+    usbh_pool(USB *usb) : dev(usb), next(usb) {}
+};
+
+template <class T>
+struct usbh_pool<T, 0>
+{
+    usbh_pool(USB *usb) { (void)usb; }
+};
+
 USB UsbHost;
-USBHub Hub(&UsbHost);
-USBHub Hub1(&UsbHost);
-USBHub Hub2(&UsbHost);
-USBHub Hub3(&UsbHost);
-USBHub Hub4(&UsbHost);
-XINPUT xinput1(&UsbHost);
-XINPUT xinput2(&UsbHost);
-XINPUT xinput3(&UsbHost);
-XINPUT xinput4(&UsbHost);
+usbh_pool<USBHub, USBH_MAX_HUBS> hubs(&UsbHost);
+usbh_pool<XINPUT, XINPUT_MAX_DEVICES> xinputs(&UsbHost);
 
 typedef struct xinput_user_data
 {
@@ -26,15 +39,31 @@ typedef struct xinput_user_data
     uint32_t button_hold_timer;
     int32_t vmouse_x;
     int32_t vmouse_y;
+    uint16_t state_seq;  //usbh_xinput_t::state_seq last mapped
+    xid_type_t type;     //Mode last mapped
+    uint32_t i2c_timer; //Last time the input report was sent to the slave
+    uint8_t interval;   //XID polling interval last sent to the slave, 0 to resend
+    uint32_t interval_timer; //Last time the interval was sent to the slave
+    uint32_t interval_hold_timer; //Start of the interval combo hold
 } xinput_user_data_t;
 
 extern usbd_controller_t usbd_c[MAX_GAMEPADS];
 xinput_user_data_t user_data[MAX_GAMEPADS];
 uint16_t sb_sensitivity = SB_DEFAULT_SENSITIVITY;
+uint8_t xid_interval = XID_INTERVAL_MS;
 
 static void handle_duke(usbh_xinput_t *_usbh_xinput, usbd_duke_t* _usbd_duke, xinput_user_data_t *_user_data);
+static void handle_duke_feedback(usbh_xinput_t *_usbh_xinput, usbd_duke_t* _usbd_duke);
 static void handle_sbattalion(usbh_xinput_t *_usbh_xinput, usbd_steelbattalion_t* _usbd_sbattalion, xinput_user_data_t *_user_data);
 
+//Set when the MAX3421E asserts INT. Starts set so a device plugged in before boot is picked up.
+static volatile uint8_t usbh_irq_pending = 1;
+
+static void usbh_irq(void)
+{
+    usbh_irq_pending = 1;
+}
+
 void master_init(void)
 {
     pinMode(USB_HOST_RESET_PIN, OUTPUT);
@@ -55,6 +84,12 @@ void master_init(void)
         delay(500);
     }
 
+    //Only root port connect/disconnect asserts INT. UHS2 also enables the 1ms frame interrupt but
+    //never clears it, enumeration polls HIRQ for the frame flag itself.
+    UsbHost.regWr(rHIEN, bmCONDETIE);
+    pinMode(USB_HOST_INT_PIN, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(USB_HOST_INT_PIN), usbh_irq, FALLING);
+
     //Ping slave devices if present. This will cause them to blink
     for (uint8_t i = 1; i < MAX_GAMEPADS; i++)
     {
@@ -79,18 +114,75 @@ void master_init(void)
     {
         EEPROM.write(0, magic);
         EEPROM.put(1, sb_sensitivity);
+        EEPROM.write(3, xid_interval);
     }
     else
     {
         EEPROM.get(1, sb_sensitivity);
+        xid_interval = EEPROM.read(3);
+    }
+    //Not set yet on modules that were setup by older firmware
+    if (!XID_INTERVAL_VALID(xid_interval))
+    {
+        xid_interval = XID_INTERVAL_MS;
+    }
+    usbh_xinput_set_idle_poll(xid_interval);
+}
+
+//Console polling interval for all players, saved to EEPROM
+static void set_xid_interval(uint8_t interval)
+{
+    if (interval == xid_interval)
+    {
+        return;
+    }
+    xid_interval = interval;
+    EEPROM.write(3, xid_interval);
+    //An idle pad is polled once per console frame, there is nothing to gain polling it faster
+    usbh_xinput_set_idle_poll(xid_interval);
+}
+
+//Console polling interval, hold BACK and LEFT_THUMB for a second then UP 1ms, RIGHT 2ms, DOWN 4ms, LEFT 8ms.
+//Works in both modes, every player's module re-enumerates with the new interval.
+static void handle_interval_combo(usbh_xinput_t *_usbh_xinput, xinput_user_data_t *_user_data)
+{
+    uint16_t combo = XINPUT_GAMEPAD_BACK | XINPUT_GAMEPAD_LEFT_THUMB;
+    if ((_usbh_xinput->pad_state.wButtons & combo) != combo)
+    {
+        _user_data->interval_hold_timer = millis();
+        return;
+    }
+    if ((millis() - _user_data->interval_hold_timer) <= 1000)
+    {
+        return;
     }
+
+    uint16_t pressed = _usbh_xinput->pad_pressed;
+    if (pressed & XINPUT_GAMEPAD_DPAD_UP) set_xid_interval(1);
+    else if (pressed & XINPUT_GAMEPAD_DPAD_RIGHT) set_xid_interval(2);
+    else if (pressed & XINPUT_GAMEPAD_DPAD_DOWN) set_xid_interval(4);
+    else if (pressed & XINPUT_GAMEPAD_DPAD_LEFT) set_xid_interval(8);
 }
 
 void master_task(void)
 {
+    //USB host transfers started by the last loop are still running, UHS2 needs the MAX3421E to itself.
+    //The hubs are registered before the xinput drivers, so during Task() they are polled first too.
+    usbh_xinput_finish_transfers(NULL);
+
+    //Probe the root port only when it changed. Devices behind a hub are handled by the hub driver.
+    if (usbh_irq_pending)
+    {
+        usbh_irq_pending = 0;
+        UsbHost.IntHandler(); //Runs busprobe() and clears CONDETIRQ
+        //A change that came in while it was being cleared keeps INT low without a new edge
+        if (digitalRead(USB_HOST_INT_PIN) == LOW)
+        {
+            usbh_irq_pending = 1;
+        }
+    }
     UsbHost.Task();
-    UsbHost.IntHandler();
-    UsbHost.busprobe();
+    usbh_xinput_poll();
 
     usbh_xinput_t *usbh_head = usbh_xinput_get_device_list();
     for (int i = 0; i < MAX_GAMEPADS; i++)
@@ -101,6 +193,11 @@ void master_task(void)
         xinput_user_data_t *_user_data = &user_data[i];
         usbd_steelbattalion_t *_usbd_sbattalion = &_usbd_c->sb;
 
+        //Pick up a report still in flight for this pad, transfers for the others keep running meanwhile
+        usbh_xinput_finish_transfers(_usbh_xinput);
+
+        _usbd_c->interval = xid_interval;
+
         if (_usbh_xinput->bAddress == 0)
         {
             _usbd_c->type = DISCONNECTED;
@@ -123,20 +220,58 @@ void master_task(void)
             _usbh_xinput->chatpad_led_requested = CHATPAD_ORANGE;
         }
 
+        if (_usbd_c->type != DISCONNECTED)
+        {
+            handle_interval_combo(_usbh_xinput, _user_data);
+        }
+
+        //Only remap the pad if it decoded a new report or the mode changed.
+        //Button edges stay latched until the mappers have run, they are acknowledged after them.
+        bool changed = _usbh_xinput->state_seq != _user_data->state_seq || _usbd_c->type != _user_data->type;
+        if (_usbd_c->type != _user_data->type)
+        {
+            //Chatpad edges latched in the old mode mean nothing in the new one
+            memset(_usbh_xinput->chatpad_keys_rising, 0, sizeof(_usbh_xinput->chatpad_keys_rising));
+            memset(_usbh_xinput->chatpad_keys_falling, 0, sizeof(_usbh_xinput->chatpad_keys_falling));
+        }
+        _user_data->type = _usbd_c->type;
+
         if (_usbd_c->type == DUKE)
         {
-            handle_duke(_usbh_xinput, _usbd_duke, _user_data);
+            if (changed)
+                handle_duke(_usbh_xinput, _usbd_duke, _user_data);
+            handle_duke_feedback(_usbh_xinput, _usbd_duke);
         }
         else if (_usbd_c->type == STEELBATTALION)
         {
+            //The aiming stick moves like a mouse cursor, so this integrates every loop.
             handle_sbattalion(_usbh_xinput, _usbd_sbattalion, _user_data);
+            changed = true;
         }
+        _user_data->state_seq = _usbh_xinput->state_seq;
+        //Presses latched since the last loop have been seen by every mapper now
+        usbh_xinput_ack_gamepad_edges(_usbh_xinput);
 
         if (i == 0)
         {
             continue;
         }
 
+        //Resend unchanged input now and then in case a slave missed it or was reset.
+        if (millis() - _user_data->i2c_timer > SLAVE_REFRESH_MS)
+        {
+            changed = true;
+        }
+
+        //A new polling interval goes out straight away. A slave that missed it is only retried every
+        //SLAVE_REFRESH_MS, so an absent slave doesn't cost a transfer every loop.
+        bool send_interval = _user_data->interval != _usbd_c->interval &&
+                             (_user_data->interval != 0 || millis() - _user_data->interval_timer > SLAVE_REFRESH_MS);
+        if (send_interval)
+        {
+            changed = true;
+        }
+
         //Now send data to slaves
         uint8_t *tx_buff = (_usbd_c->type == DUKE)            ? ((uint8_t *)&_usbd_duke->in) :
                            (_usbd_c->type == STEELBATTALION) ? ((uint8_t *)&_usbd_sbattalion->in) :
@@ -152,13 +287,33 @@ void master_task(void)
                            0;
         uint8_t status = 0xF0 | _usbd_c->type;
 
-        Wire.beginTransmission(i);
-        Wire.write(status);
-        if (tx_buff != NULL && tx_len != 0)
+        //Rumble is read back from the slave every loop, the input report only when it changed.
+        if (changed)
         {
-            Wire.write(tx_buff, tx_len);
+            //Polling interval packet 0xBx, where 'x' is the interval in ms. Only sent when it changed or
+            //the slave is back after missing a packet. It goes first so the slave attaches to its
+            //console with it.
+            if (send_interval)
+            {
+                Wire.beginTransmission(i);
+                Wire.write(0xB0 | _usbd_c->interval);
+                _user_data->interval = (Wire.endTransmission(true) == 0) ? _usbd_c->interval : 0;
+                _user_data->interval_timer = millis();
+            }
+
+            Wire.beginTransmission(i);
+            Wire.write(status);
+            if (tx_buff != NULL && tx_len != 0)
+            {
+                Wire.write(tx_buff, tx_len);
+            }
+            //A slave that didn't answer may have been reset, it gets the interval again once it's back
+            if (Wire.endTransmission(true) != 0)
+            {
+                _user_data->interval = 0;
+            }
+            _user_data->i2c_timer = millis();
         }
-        Wire.endTransmission(true);
 
         if (rx_buff != NULL && rx_len != 0)
         {
@@ -179,60 +334,59 @@ void master_task(void)
     }
 }
 
+//A/B/X/Y (XINPUT_GAMEPAD_x bits 12-15) and BLACK/WHITE (bits 9 and 8) to the analog button bytes
+#define DUKE_ABXY(v) {BTN(v, 0, 0xFF), BTN(v, 1, 0xFF), BTN(v, 2, 0xFF), BTN(v, 3, 0xFF)},
+#define DUKE_BLACK_WHITE(v) {BTN(v, 1, 0xFF), BTN(v, 0, 0xFF)},
+static const uint8_t duke_abxy[16][4] PROGMEM = {BTN_REP16(DUKE_ABXY, 0)};
+static const uint8_t duke_black_white[4][2] PROGMEM = {BTN_REP4(DUKE_BLACK_WHITE, 0)};
+
 static void handle_duke(usbh_xinput_t *_usbh_xinput, usbd_duke_t* _usbd_duke, xinput_user_data_t *_user_data)
 {
     xinput_padstate_t *usbh_xstate = &_usbh_xinput->pad_state;
-    memset(&_usbd_duke->in.wButtons, 0x00, 8); //Also clears A/B/X/Y,BLACK,WHITE
-
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_DPAD_UP) _usbd_duke->in.wButtons |= DUKE_DUP;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_DPAD_DOWN) _usbd_duke->in.wButtons |= DUKE_DDOWN;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_DPAD_LEFT) _usbd_duke->in.wButtons |= DUKE_DLEFT;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_DPAD_RIGHT) _usbd_duke->in.wButtons |= DUKE_DRIGHT;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_START) _usbd_duke->in.wButtons |= DUKE_START;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_BACK) _usbd_duke->in.wButtons |= DUKE_BACK;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_LEFT_THUMB) _usbd_duke->in.wButtons |= DUKE_LS;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_RIGHT_THUMB) _usbd_duke->in.wButtons |= DUKE_RS;
+    uint16_t pressed = _usbh_xinput->pad_pressed;
+    //DUKE_x digital buttons share their bit positions with XINPUT_GAMEPAD_x
+    _usbd_duke->in.wButtons = usbh_xstate->wButtons & 0x00FF;
 
     //Analog buttons are converted to digital
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_LEFT_SHOULDER) _usbd_duke->in.WHITE = 0xFF;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_RIGHT_SHOULDER) _usbd_duke->in.BLACK = 0xFF;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_A) _usbd_duke->in.A = 0xFF;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_B) _usbd_duke->in.B = 0xFF;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_X) _usbd_duke->in.X = 0xFF;
-    if (usbh_xstate->wButtons & XINPUT_GAMEPAD_Y) _usbd_duke->in.Y = 0xFF;
-
-    //Analog Sticks
-    _usbd_duke->in.leftStickX  = usbh_xstate->sThumbLX;
-    _usbd_duke->in.leftStickY  = usbh_xstate->sThumbLY;
-    _usbd_duke->in.rightStickX = usbh_xstate->sThumbRX;
-    _usbd_duke->in.rightStickY = usbh_xstate->sThumbRY;
-    _usbd_duke->in.L           = usbh_xstate->bLeftTrigger;
-    _usbd_duke->in.R           = usbh_xstate->bRightTrigger;
-
-    _usbh_xinput->chatpad_led_requested = CHATPAD_GREEN;
-    _usbh_xinput->lValue_requested = _usbd_duke->out.lValue >> 8;
-    _usbh_xinput->rValue_requested = _usbd_duke->out.hValue >> 8;
+    uint8_t hi = usbh_xstate->wButtons >> 8;
+    memcpy_P(&_usbd_duke->in.A, duke_abxy[hi >> 4], 4);
+    memcpy_P(&_usbd_duke->in.BLACK, duke_black_white[hi & 0x03], 2);
 
+    //Toggle the right stick inversion first so the report that toggles it already uses the new orientation
 #define XINPUT_MOD_RSX_INVERT (1 << 0)
 #define XINPUT_MOD_RSY_INVERT (1 << 1)
-    if (_user_data->modifiers & XINPUT_MOD_RSY_INVERT) _usbd_duke->in.rightStickY = -usbh_xstate->sThumbRY - 1;
-    if (_user_data->modifiers & XINPUT_MOD_RSX_INVERT) _usbd_duke->in.rightStickX = -usbh_xstate->sThumbRX - 1;
-    
     if (usbh_xstate->wButtons & XINPUT_GAMEPAD_RIGHT_THUMB)
     {
-        if(usbh_xinput_was_gamepad_pressed(_usbh_xinput, XINPUT_GAMEPAD_DPAD_UP) ||
-           usbh_xinput_was_gamepad_pressed(_usbh_xinput, XINPUT_GAMEPAD_DPAD_DOWN))
+        if(pressed & (XINPUT_GAMEPAD_DPAD_UP | XINPUT_GAMEPAD_DPAD_DOWN))
         {
             (_user_data->modifiers & XINPUT_MOD_RSY_INVERT) ? _user_data->modifiers &= ~XINPUT_MOD_RSY_INVERT :
                                                               _user_data->modifiers |=  XINPUT_MOD_RSY_INVERT;
         }
-        if(usbh_xinput_was_gamepad_pressed(_usbh_xinput, XINPUT_GAMEPAD_DPAD_RIGHT) ||
-           usbh_xinput_was_gamepad_pressed(_usbh_xinput, XINPUT_GAMEPAD_DPAD_LEFT))
+        if(pressed & (XINPUT_GAMEPAD_DPAD_RIGHT | XINPUT_GAMEPAD_DPAD_LEFT))
         {
             (_user_data->modifiers & XINPUT_MOD_RSX_INVERT) ? _user_data->modifiers &= ~XINPUT_MOD_RSX_INVERT :
                                                               _user_data->modifiers |=  XINPUT_MOD_RSX_INVERT;
         }
     }
+
+    //Analog Sticks
+    _usbd_duke->in.leftStickX  = usbh_xstate->sThumbLX;
+    _usbd_duke->in.leftStickY  = usbh_xstate->sThumbLY;
+    _usbd_duke->in.rightStickX = usbh_xstate->sThumbRX;
+    _usbd_duke->in.rightStickY = usbh_xstate->sThumbRY;
+    _usbd_duke->in.L           = usbh_xstate->bLeftTrigger;
+    _usbd_duke->in.R           = usbh_xstate->bRightTrigger;
+
+    if (_user_data->modifiers & XINPUT_MOD_RSY_INVERT) _usbd_duke->in.rightStickY = -usbh_xstate->sThumbRY - 1;
+    if (_user_data->modifiers & XINPUT_MOD_RSX_INVERT) _usbd_duke->in.rightStickX = -usbh_xstate->sThumbRX - 1;
+}
+
+//Rumble comes from the console, so this runs even when the pad state hasn't changed.
+static void handle_duke_feedback(usbh_xinput_t *_usbh_xinput, usbd_duke_t* _usbd_duke)
+{
+    _usbh_xinput->chatpad_led_requested = CHATPAD_GREEN;
+    _usbh_xinput->lValue_requested = _usbd_duke->out.lValue >> 8;
+    _usbh_xinput->rValue_requested = _usbd_duke->out.hValue >> 8;
 }
 
 typedef struct __attribute__((packed))
@@ -317,6 +471,7 @@ static const sb_map_t sb_chatpad_toggle_map [] PROGMEM =
 static void handle_sbattalion(usbh_xinput_t *_usbh_xinput, usbd_steelbattalion_t *_usbd_sbattalion, xinput_user_data_t *_user_data)
 {
     xinput_padstate_t *usbh_xstate = &_usbh_xinput->pad_state;
+    uint16_t pressed = _usbh_xinput->pad_pressed;
     _usbd_sbattalion->in.wButtons[0] = 0x0000;
     _usbd_sbattalion->in.wButtons[1] = 0x0000;
     _usbd_sbattalion->in.wButtons[2] &= 0xFFFC; //Dont clear toggle switches
@@ -366,12 +521,10 @@ static void handle_sbattalion(usbh_xinput_t *_usbh_xinput, usbd_steelbattalion_t
 
         //Change tuner dial position by Holding the messenger then pressing D-pad directions.
         //Tuner dial = 0-15, corresponding to the 9o'clock position going clockwise.
-        if (usbh_xinput_was_gamepad_pressed(_usbh_xinput, XINPUT_GAMEPAD_DPAD_UP) ||
-            usbh_xinput_was_gamepad_pressed(_usbh_xinput, XINPUT_GAMEPAD_DPAD_RIGHT))
+        if (pressed & (XINPUT_GAMEPAD_DPAD_UP | XINPUT_GAMEPAD_DPAD_RIGHT))
             _usbd_sbattalion->in.tunerDial += (_usbd_sbattalion->in.tunerDial < 15) ? 1 : -15;
 
-        if (usbh_xinput_was_gamepad_pressed(_usbh_xinput, XINPUT_GAMEPAD_DPAD_DOWN) ||
-            usbh_xinput_was_gamepad_pressed(_usbh_xinput, XINPUT_GAMEPAD_DPAD_LEFT))
+        if (pressed & (XINPUT_GAMEPAD_DPAD_DOWN | XINPUT_GAMEPAD_DPAD_LEFT))
             _usbd_sbattalion->in.tunerDial -= (_usbd_sbattalion->in.tunerDial > 0) ? 1 : -15;
     }
     //The default configuration
@@ -390,9 +543,9 @@ static void handle_sbattalion(usbh_xinput_t *_usbh_xinput, usbd_steelbattalion_t
         if (!(usbh_xstate->wButtons & XINPUT_GAMEPAD_DPAD_LEFT) &&
             !(usbh_xstate->wButtons & XINPUT_GAMEPAD_DPAD_RIGHT))
         {
-            if (usbh_xinput_was_gamepad_pressed(_usbh_xinput, XINPUT_GAMEPAD_DPAD_UP))
+            if (pressed & XINPUT_GAMEPAD_DPAD_UP)
                 _usbd_sbattalion->in.gearLever += (_usbd_sbattalion->in.gearLever < SBC_GEAR_5) ? 1 : 0;
-            if (usbh_xinput_was_gamepad_pressed(_usbh_xinput, XINPUT_GAMEPAD_DPAD_DOWN))
+            if (pressed & XINPUT_GAMEPAD_DPAD_DOWN)
                 _usbd_sbattalion->in.gearLever -= (_usbd_sbattalion->in.gearLever > SBC_GEAR_R) ? 1 : 0;
         }
     }
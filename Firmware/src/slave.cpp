@@ -22,6 +22,13 @@ void i2c_get_data(int len)
         goto flush_and_leave;
     }
 
+    //Polling interval packet 0xBx, where 'x' is the XID endpoint bInterval in ms.
+    if ((packet_id & 0xF0) == 0xB0)
+    {
+        usbd_c[0].interval = packet_id & 0x0F;
+        goto flush_and_leave;
+    }
+
     //Controller state packet 0xFx, where 'x' is the controller type.
     if ((packet_id & 0xF0) == 0xF0)
     {
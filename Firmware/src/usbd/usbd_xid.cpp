@@ -10,6 +10,16 @@
 #define USBD_XID_DEBUG(...)
 #endif
 
+//sendReport() replaces an unread report in the second bank of the IN endpoint. The core only
+//configures endpoints double banked (EP_DOUBLE_64) when they are 64 bytes.
+static_assert(USB_EP_SIZE == 64, "XID IN endpoint must be double banked, see XID_::sendReport()");
+
+//Polls of KILLBK before giving up, under 0.1ms at 16MHz
+#define XID_KILLBK_TIMEOUT 255
+
+//Keeps the compiler from moving mailbox accesses across the seq updates
+#define XID_BARRIER() __asm__ __volatile__("" ::: "memory")
+
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
@@ -26,8 +36,8 @@ int XID_::getInterface(uint8_t *interfaceCount)
 
     XIDDescriptor xid_interface = {
         D_INTERFACE(pluggedInterface, 2, XID_INTERFACECLASS, XID_INTERFACESUBCLASS, 0),
-        D_ENDPOINT(USB_ENDPOINT_IN(XID_EP_IN), USB_ENDPOINT_TYPE_INTERRUPT, USB_EP_SIZE, 0x04),
-        D_ENDPOINT(USB_ENDPOINT_OUT(XID_EP_OUT), USB_ENDPOINT_TYPE_INTERRUPT, USB_EP_SIZE, 0x04)};
+        D_ENDPOINT(USB_ENDPOINT_IN(XID_EP_IN), USB_ENDPOINT_TYPE_INTERRUPT, USB_EP_SIZE, xid_interval),
+        D_ENDPOINT(USB_ENDPOINT_OUT(XID_EP_OUT), USB_ENDPOINT_TYPE_INTERRUPT, USB_EP_SIZE, xid_interval)};
 
     return USB_SendControl(0, &xid_interface, sizeof(xid_interface));
 }
@@ -39,40 +49,110 @@ int XID_::getDescriptor(USBSetup &setup)
     return sizeof(xid_dev_descriptor);
 }
 
+//Sends the report if it changed, it never waits for the console to poll. The IN endpoint is double
+//banked (EP_DOUBLE_64 in the core's InitEndpoints), the console reads the oldest bank first. If both
+//banks are full the newer one hasn't been read yet, so it is killed and replaced with this report.
+//Returns 0 if the changed report couldn't be queued, call again with the latest one.
 int XID_::sendReport(const void *data, int len)
 {
     int capped_len = min((unsigned int)len, sizeof(xid_in_data));
-    if (memcmp(xid_in_data, data, capped_len) != 0)
+    if (memcmp(xid_in_data, data, capped_len) == 0)
+    {
+        return len;
+    }
+
+    //Same as LockEP in the core, the USB interrupt selects endpoint 0 through UENUM.
+    //NBUSYBK only reaches 2 on a double banked endpoint, a single banked one never takes this path.
+    uint8_t sreg = SREG;
+    cli();
+    UENUM = XID_EP_IN;
+    if ((UESTA0X & 0x03) == 2)
+    {
+        //KILLBK shares bit 2 with RXOUTI, cleared by hardware once the last written bank is gone.
+        //The killed bank isn't the one being sent so this is quick, but don't hang with interrupts
+        //off if the controller never gets to it, e.g when suspended. Try again next loop.
+        UEINTX |= (1 << RXOUTI);
+        uint8_t timeout = XID_KILLBK_TIMEOUT;
+        while ((UEINTX & (1 << RXOUTI)) && --timeout)
+            ;
+        if (timeout == 0)
+        {
+            SREG = sreg;
+            return 0;
+        }
+        xid_report_count--; //Never read by the console
+        USBD_XID_DEBUG("USBD XID: REPLACED PENDING REPORT\n");
+    }
+    SREG = sreg;
+
+    //A single banked endpoint that is still full, USB_Send() would block until the console reads it
+    if (USB_SendSpace(XID_EP_IN) < capped_len)
+    {
+        return 0;
+    }
+
+    //Update local copy, then send
+    if (USB_Send(XID_EP_IN | TRANSFER_RELEASE, data, capped_len) == len)
     {
-        //Update local copy, then send
-        if (USB_Send(XID_EP_IN | TRANSFER_RELEASE, data, capped_len) == len)
-            memcpy(xid_in_data, data, capped_len);
+        memcpy(xid_in_data, data, capped_len);
+        xid_report_count++;
     }
     return len;
 }
 
+//Copies the latest output report to data when it changed since the last call. Returns the length
+//copied, 0 if no report arrived for XID_OUT_TIMEOUT_MS and data was cleared, otherwise bLength of the
+//report data already holds.
 int XID_::getReport(void *data, int len)
 {
-    int capped_len = min((uint32_t)len, sizeof(xid_out_data));
-    uint8_t r[capped_len] = {0};
-    if (USB_Recv(XID_EP_OUT | TRANSFER_RELEASE, r, capped_len) == capped_len)
+    int capped_len = min((unsigned int)len, sizeof(xid_out.data));
+
+    //Publish a full report from the interrupt pipe, anything shorter is dropped
+    if (USB_Available(XID_EP_OUT))
     {
-        USBD_XID_DEBUG("USBD XID: GOT HID REPORT OUT FROM ENDPOINT\n");
-        memcpy(xid_out_data, r, capped_len);
-        memcpy(data, r, capped_len);
-        xid_out_expired = millis();
-        return capped_len;
+        uint8_t r[sizeof(xid_out.data)];
+        if (USB_Recv(XID_EP_OUT | TRANSFER_RELEASE, r, sizeof(r)) == capped_len)
+        {
+            uint8_t sreg = SREG;
+            cli();
+            xid_out.seq++;
+            XID_BARRIER();
+            memcpy(xid_out.data, r, capped_len);
+            xid_out.timestamp = millis();
+            XID_BARRIER();
+            xid_out.seq++;
+            SREG = sreg;
+            USBD_XID_DEBUG("USBD XID: GOT HID REPORT OUT FROM ENDPOINT\n");
+        }
     }
-    //No new data on interrupt pipe, if its been a while since last update,
-    //Treat it as expired. Prevents rumble locking on old values.
-    if(millis() - xid_out_expired > 500)
+
+    //A SET_REPORT from the interrupt can land in the middle of the copy, go again if seq moved
+    uint8_t seq;
+    uint32_t timestamp;
+    bool copied = false;
+    do
+    {
+        seq = xid_out.seq;
+        XID_BARRIER();
+        timestamp = xid_out.timestamp;
+        if (seq != xid_out_seq || data != xid_out_dest)
+        {
+            memcpy(data, xid_out.data, capped_len);
+            copied = true;
+        }
+        XID_BARRIER();
+    } while (seq != xid_out.seq);
+    xid_out_seq = seq;
+    xid_out_dest = data;
+
+    //Treat an old report as expired. Prevents rumble locking on old values.
+    if (millis() - timestamp > XID_OUT_TIMEOUT_MS)
     {
         memset(data, 0x00, capped_len);
+        xid_out_dest = NULL;
         return 0;
     }
-    //No new data on interrupt pipe, return previous data
-    memcpy(data, xid_out_data, capped_len);
-    return xid_out_data[1];
+    return (copied) ? capped_len : ((uint8_t *)data)[1];
 }
 
 bool XID_::setup(USBSetup &setup)
@@ -130,9 +210,13 @@ bool XID_::setup(USBSetup &setup)
         if (request == HID_SET_REPORT && setup.wValueH == HID_REPORT_TYPE_OUTPUT)
         {
             USBD_XID_DEBUG("USBD XID: GETTING HID REPORT OUT\n");
-            uint16_t length = min(sizeof(xid_out_data), setup.wLength);
-            USB_RecvControl(xid_out_data, length);
-            xid_out_expired = millis();
+            uint16_t length = min(sizeof(xid_out.data), setup.wLength);
+            xid_out.seq++;
+            XID_BARRIER();
+            USB_RecvControl(xid_out.data, length);
+            xid_out.timestamp = millis();
+            XID_BARRIER();
+            xid_out.seq++;
             return true;
         }
     }
@@ -152,12 +236,7 @@ void XID_::setType(xid_type_t type)
     }
 
     xid_type = type;
-    UDCON |= (1 << DETACH);
-    delay(10);
-    if (xid_type != DISCONNECTED)
-    {
-        UDCON &= ~(1 << DETACH);
-    } 
+    detach();
     return;
 }
 
@@ -166,13 +245,66 @@ xid_type_t XID_::getType(void)
     return xid_type;
 }
 
+//The interval is part of the endpoint descriptors, so the console only picks up a new one if it
+//enumerates the device again after the detach. Same detach/attach as a type change.
+void XID_::setInterval(uint8_t ms)
+{
+    if (!XID_INTERVAL_VALID(ms))
+    {
+        ms = XID_INTERVAL_MS;
+    }
+    if (xid_interval == ms)
+    {
+        return;
+    }
+
+    xid_interval = ms;
+    detach();
+}
+
+//Drops off the bus without blocking, task() attaches again XID_DETACH_MS later.
+void XID_::detach(void)
+{
+    UDCON |= (1 << DETACH);
+    xid_detached = 1;
+    xid_detach_timer = millis();
+}
+
+//Attaches again once a detach has lasted XID_DETACH_MS, unless the type is DISCONNECTED.
+//Returns false while the device is off the bus, reports can't be sent then.
+bool XID_::task(void)
+{
+    if (xid_detached && xid_type != DISCONNECTED && (millis() - xid_detach_timer) >= XID_DETACH_MS)
+    {
+        UDCON &= ~(1 << DETACH);
+        xid_detached = 0;
+    }
+    return !xid_detached;
+}
+
+uint8_t XID_::getInterval(void)
+{
+    return xid_interval;
+}
+
+uint16_t XID_::getReportCount(void)
+{
+    return xid_report_count;
+}
+
 XID_::XID_(void) : PluggableUSBModule(2, 1, epType)
 {
     epType[0] = EP_TYPE_INTERRUPT_IN;
     epType[1] = EP_TYPE_INTERRUPT_OUT;
-    memset(xid_out_data, 0x00, sizeof(xid_out_data));
+    memset(&xid_out, 0x00, sizeof(xid_out));
+    xid_out_seq = 0;
+    xid_out_dest = NULL;
     memset(xid_in_data, 0x00, sizeof(xid_in_data));
     xid_type = DUKE;
+    xid_interval = XID_INTERVAL_MS;
+    xid_detached = 0;
+    xid_detach_timer = 0;
+    xid_report_count = 0;
     PluggableUSB().plug(this);
 }
 
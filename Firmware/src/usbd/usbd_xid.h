@@ -19,6 +19,23 @@
 #define HID_REPORT_TYPE_OUTPUT 2
 #endif
 
+//bInterval of both interrupt endpoints in ms. The console polls the IN endpoint at this rate, so it
+//caps how often a new input report can reach the game. 1, 2, 4 or 8. The stock Duke uses 4.
+#ifndef XID_INTERVAL_MS
+#define XID_INTERVAL_MS 4
+#endif
+#define XID_INTERVAL_VALID(ms) ((ms) == 1 || (ms) == 2 || (ms) == 4 || (ms) == 8)
+
+//How long the device stays detached so the console sees a type or interval change as a new device
+#ifndef XID_DETACH_MS
+#define XID_DETACH_MS 10
+#endif
+
+//Rumble is switched off if the console hasn't sent an output report for this long
+#ifndef XID_OUT_TIMEOUT_MS
+#define XID_OUT_TIMEOUT_MS 500
+#endif
+
 #define XID_EP_IN (pluggedEndpoint)
 #define XID_EP_OUT (pluggedEndpoint + 1)
 
@@ -224,6 +241,16 @@ typedef struct __attribute__((packed))
     usbd_sbattalion_out_t out;
 } usbd_steelbattalion_t;
 
+//Latest output report from the console. HID_SET_REPORT publishes it from the USB interrupt and the
+//interrupt OUT endpoint from getReport() with interrupts off, so there is one writer at a time.
+//seq is incremented before and after each write, a reader that sees it change copies again.
+typedef struct
+{
+    volatile uint8_t seq;
+    uint32_t timestamp; //millis() when the report was written
+    uint8_t data[32];
+} xid_out_mailbox_t;
+
 typedef enum
 {
     DISCONNECTED = 0,
@@ -240,6 +267,10 @@ public:
     int getReport(void *data, int len);
     void setType(xid_type_t type);
     xid_type_t getType(void);
+    void setInterval(uint8_t ms);
+    uint8_t getInterval(void);
+    uint16_t getReportCount(void);
+    bool task(void);
 
 protected:
     int getInterface(uint8_t *interfaceCount);
@@ -247,11 +278,17 @@ protected:
     bool setup(USBSetup &setup);
 
 private:
+    void detach(void);
     xid_type_t xid_type;
+    uint8_t xid_interval;
+    uint8_t xid_detached;      //Detached by detach() and not attached again by task() yet
+    uint32_t xid_detach_timer; //millis() at the last detach()
+    uint16_t xid_report_count; //Input reports queued and not replaced before the console read them, wraps
     uint8_t epType[2];
     uint8_t xid_in_data[32];
-    uint8_t xid_out_data[32];
-    uint32_t xid_out_expired;
+    xid_out_mailbox_t xid_out;
+    uint8_t xid_out_seq;    //xid_out.seq last copied by getReport()
+    void *xid_out_dest;     //Buffer it was copied to
 };
 
 XID_ &XID();
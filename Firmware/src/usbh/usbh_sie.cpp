@@ -0,0 +1,104 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "usbh_sie.h"
+
+static EpInfo *sie_ep;     //Endpoint of the transaction in flight, NULL when idle
+static uint8_t sie_token;  //tokIN or tokOUT
+static uint32_t sie_timer; //Start of the transaction in flight
+
+//Same as the address and speed setup in USB::SetAddress()
+static void sie_setup(USB *usb, uint8_t addr)
+{
+    usb->regWr(rPERADDR, addr);
+    uint8_t mode = usb->regRd(rMODE);
+    usb->regWr(rMODE, mode & ~(bmHUBPRE | bmLOWSPEED));
+}
+
+void usbh_sie_start_in(USB *usb, uint8_t addr, EpInfo *ep)
+{
+    sie_setup(usb, addr);
+    usb->regWr(rHCTL, (ep->bmRcvToggle) ? bmRCVTOG1 : bmRCVTOG0);
+    usb->regWr(rHXFR, tokIN | ep->epAddr);
+    sie_ep = ep;
+    sie_token = tokIN;
+    sie_timer = millis();
+}
+
+void usbh_sie_start_out(USB *usb, uint8_t addr, EpInfo *ep, const uint8_t *data, uint8_t len)
+{
+    sie_setup(usb, addr);
+    usb->regWr(rHCTL, (ep->bmSndToggle) ? bmSNDTOG1 : bmSNDTOG0);
+    usb->bytesWr(rSNDFIFO, len, (uint8_t *)data);
+    usb->regWr(rSNDBC, len);
+    usb->regWr(rHXFR, tokOUT | ep->epAddr);
+    sie_ep = ep;
+    sie_token = tokOUT;
+    sie_timer = millis();
+}
+
+bool usbh_sie_active(void)
+{
+    return sie_ep != NULL;
+}
+
+bool usbh_sie_busy(USB *usb)
+{
+    if (sie_ep == NULL)
+        return false;
+
+    return !(usb->regRd(rHIRQ) & bmHXFRDNIRQ) && (millis() - sie_timer) < USBH_SIE_TIMEOUT_MS;
+}
+
+//Waits for the transaction in flight if it hasn't completed yet. For IN transfers *len is the size
+//of data on entry and the number of bytes received on return.
+uint8_t usbh_sie_finish(USB *usb, uint8_t *data, uint8_t *len)
+{
+    if (sie_ep == NULL)
+        return hrSUCCESS;
+
+    while (usbh_sie_busy(usb))
+        ;
+
+    EpInfo *ep = sie_ep;
+    sie_ep = NULL;
+    if (!(usb->regRd(rHIRQ) & bmHXFRDNIRQ))
+    {
+        return hrTIMEOUT;
+    }
+    usb->regWr(rHIRQ, bmHXFRDNIRQ);
+
+    uint8_t hrsl = usb->regRd(rHRSL);
+    uint8_t rcode = hrsl & 0x0F;
+    if (rcode == hrTOGERR)
+    {
+        //Resync with the device, the transfer is retried on its next interval
+        if (sie_token == tokIN)
+            ep->bmRcvToggle ^= 1;
+        else
+            ep->bmSndToggle ^= 1;
+    }
+    if (rcode != hrSUCCESS)
+    {
+        return rcode;
+    }
+
+    if (sie_token == tokOUT)
+    {
+        ep->bmSndToggle = (hrsl & bmSNDTOGRD) ? 1 : 0;
+        return hrSUCCESS;
+    }
+
+    if (!(usb->regRd(rHIRQ) & bmRCVDAVIRQ))
+    {
+        return 0xF0; //Receive error, same as USB::InTransfer()
+    }
+    uint8_t pktsize = usb->regRd(rRCVBC);
+    if (pktsize > *len)
+        pktsize = *len;
+    usb->bytesRd(rRCVFIFO, pktsize, data);
+    usb->regWr(rHIRQ, bmRCVDAVIRQ);
+    ep->bmRcvToggle = (hrsl & bmRCVTOGRD) ? 1 : 0;
+    *len = pktsize;
+    return hrSUCCESS;
+}
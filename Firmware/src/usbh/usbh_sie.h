@@ -0,0 +1,28 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _USBH_SIE_H_
+#define _USBH_SIE_H_
+
+#include <UHS2/Usb.h>
+
+//Split-phase interrupt transfers on the MAX3421E. usbh_sie_start_in()/usbh_sie_start_out() load the
+//transaction and return straight away, the CPU is free until HXFRDN is set. usbh_sie_finish() then
+//collects the result the same way USB::inTransfer()/outTransfer() would have returned it.
+//
+//The SIE only runs one transaction at a time and UHS2 drives it with blocking calls, so a started
+//transaction must be finished before anything calls into UHS2 again. One attempt is made per
+//transaction, a NAK is returned to the caller to retry on its next interval.
+//Full speed devices only, low speed devices need the MODE/HUBPRE setup that UHS2 keeps private.
+
+#ifndef USBH_SIE_TIMEOUT_MS
+#define USBH_SIE_TIMEOUT_MS 50 //The MAX3421E times out a lost device itself, this only guards the SPI loop
+#endif
+
+void usbh_sie_start_in(USB *usb, uint8_t addr, EpInfo *ep);
+void usbh_sie_start_out(USB *usb, uint8_t addr, EpInfo *ep, const uint8_t *data, uint8_t len);
+bool usbh_sie_active(void);
+bool usbh_sie_busy(USB *usb);
+uint8_t usbh_sie_finish(USB *usb, uint8_t *data, uint8_t *len);
+
+#endif
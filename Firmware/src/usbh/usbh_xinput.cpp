@@ -1,8 +1,11 @@
 // Copyright 2021, Ryan Wendland, ogx360
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#include <util/crc16.h>
 #include <UHS2/usbhid.h>
+#include <EEPROM.h>
 #include "usbh_xinput.h"
+#include "usbh_sie.h"
 
 //#define ENABLE_USBH_XINPUT_DEBUG
 #ifdef ENABLE_USBH_XINPUT_DEBUG
@@ -16,8 +19,67 @@
 #define GET_SHORT(a, b) *((int16_t *)a[b])
 #define GET_UINT(a, b) *((uint32_t *)a[b])
 
+//Xbox One buttons are in a different order, so each report byte goes through a 256 entry lookup.
+//The 360 and OG layouts already match XINPUT_GAMEPAD_x and only need masking.
+#define XBOXONE_BTN_LO(v) (uint16_t)(BTN(v, 2, XINPUT_GAMEPAD_START) | BTN(v, 3, XINPUT_GAMEPAD_BACK) | \
+                                     BTN(v, 4, XINPUT_GAMEPAD_A) | BTN(v, 5, XINPUT_GAMEPAD_B) |         \
+                                     BTN(v, 6, XINPUT_GAMEPAD_X) | BTN(v, 7, XINPUT_GAMEPAD_Y)),
+#define XBOXONE_BTN_HI(v) (uint16_t)(BTN(v, 0, XINPUT_GAMEPAD_DPAD_UP) | BTN(v, 1, XINPUT_GAMEPAD_DPAD_DOWN) |             \
+                                     BTN(v, 2, XINPUT_GAMEPAD_DPAD_LEFT) | BTN(v, 3, XINPUT_GAMEPAD_DPAD_RIGHT) |         \
+                                     BTN(v, 4, XINPUT_GAMEPAD_LEFT_SHOULDER) | BTN(v, 5, XINPUT_GAMEPAD_RIGHT_SHOULDER) | \
+                                     BTN(v, 6, XINPUT_GAMEPAD_LEFT_THUMB) | BTN(v, 7, XINPUT_GAMEPAD_RIGHT_THUMB)),
+static const uint16_t xboxone_buttons_lo[256] PROGMEM = {BTN_REP256(XBOXONE_BTN_LO)};
+static const uint16_t xboxone_buttons_hi[256] PROGMEM = {BTN_REP256(XBOXONE_BTN_HI)};
+
+#define XBOX360_WIRED_BUTTONS (uint16_t)~(XINPUT_GAMEPAD_XBOX_BUTTON | XINPUT_GAMEPAD_SYNC)
+#define XBOX360_WIRELESS_BUTTONS (uint16_t)~(XINPUT_GAMEPAD_SYNC)
+#define XBOXOG_BUTTONS 0x00FF //A/B/X/Y/BLACK/WHITE are analog on the OG controller
+
 static usbh_xinput_t xinput_devices[XINPUT_MAXGAMEPADS];
-static uint8_t xdata[384];
+static const xinput_driver_t *xinput_get_driver(xinput_type_t type);
+static uint8_t xdata[64]; //One full speed control packet, descriptors are streamed through it
+static xinput_transfer_t xinput_xfer; //The MAX3421E runs one transfer at a time for all devices
+static XINPUT *xinput_instances[XINPUT_MAX_DEVICES];
+
+//Shared pipe pool, see XINPUT::bind_pipes()
+static EpInfo xinput_pipe_info[XINPUT_MAX_PIPES];
+static uint8_t xinput_pipe_slot[XINPUT_MAX_PIPES];
+static uint8_t xinput_pipe_interval[XINPUT_MAX_PIPES];
+static uint16_t xinput_pipe_next[XINPUT_MAX_PIPES];
+static uint8_t xinput_pipe_backoff[XINPUT_MAX_PIPES];
+static uint8_t xinput_num_instances;
+static uint8_t xinput_rr; //Instance serviced first by usbh_xinput_poll()
+static uint8_t xinput_idle_poll_ms = XINPUT_IDLE_POLL_MS;
+
+//Enumeration after SET_ADDRESS runs from usbh_xinput_poll(), one control transfer per call, so
+//hot-plugging a device doesn't stall the pads that are already connected. See XINPUT::EnumStep().
+enum
+{
+    XINPUT_ENUM_SETTLE,
+    XINPUT_ENUM_DEV_DESCR,
+    XINPUT_ENUM_CONF_HEADER,
+    XINPUT_ENUM_CONF,
+    XINPUT_ENUM_SET_CONF,
+    XINPUT_ENUM_INQUIRE,
+    XINPUT_ENUM_PRODUCT_LEN,
+    XINPUT_ENUM_PRODUCT,
+    XINPUT_ENUM_ALLOC,
+    XINPUT_ENUM_DONE
+};
+
+//One device enumerates at a time, a second one finishes the first before it starts
+static struct
+{
+    XINPUT *dev; //NULL if no device is enumerating
+    uint8_t step;
+    uint8_t cache_slot;
+    uint8_t conf_value;
+    uint8_t next_itf;    //Interface the INQUIRE or ALLOC step looks at next
+    uint8_t product_len; //Length of the product string descriptor
+    uint16_t bcdDevice;
+    uint16_t total_len;  //wTotalLength of the configuration descriptor
+    uint16_t timer;      //Low 16 bits of millis() at SET_ADDRESS
+} xinput_enum;
 
 #ifdef ENABLE_USBH_XINPUT_DEBUG
 static void PrintHex8(uint8_t *data, uint8_t length) // prints 8-bit data in hex with leading zeroes
@@ -33,6 +95,101 @@ static void PrintHex8(uint8_t *data, uint8_t length) // prints 8-bit data in hex
 }
 #endif
 
+#ifdef ENABLE_USBH_XINPUT_CAPTURE
+//Streams an IN report on Serial1 in the xinput_capture_t format. See native/replay.cpp to play it back.
+static void CaptureInputData(uint8_t bAddress, uint8_t epAddr, xinput_type_t type, uint8_t *data, uint16_t len)
+{
+    xinput_capture_t rec;
+    rec.sync = XINPUT_CAPTURE_SYNC;
+    rec.len = len;
+    rec.timestamp = micros();
+    rec.bAddress = bAddress;
+    rec.epAddr = epAddr;
+    rec.type = type;
+    Serial1.write((uint8_t *)&rec, sizeof(rec));
+    Serial1.write(data, len);
+}
+#endif
+
+#ifdef ENABLE_USBH_XINPUT_STATS
+static void xinput_stats_count(usbh_xinput_t *xinput, const xinput_transfer_t *xfer, bool in, uint8_t rcode)
+{
+    xinput_stats_t *s = &xinput->stats;
+    if (!in)
+    {
+        if (rcode != hrSUCCESS)
+        {
+            s->out_errors++;
+            return;
+        }
+        uint8_t kind = 0;
+        while (kind < XINPUT_OUT_KINDS - 1 && !(xfer->cmd & (1 << kind)))
+            kind++;
+        s->out_sent[kind]++;
+        return;
+    }
+
+    if (rcode == hrNAK)
+    {
+        s->in_naks++;
+        return;
+    }
+    if (rcode != hrSUCCESS)
+    {
+        s->in_errors++;
+        return;
+    }
+
+    uint32_t now = millis();
+    if (s->in_reports++ != 0)
+    {
+        uint32_t interval = now - s->last_report;
+        uint8_t bin = 0;
+        while (interval && bin < XINPUT_STATS_BINS - 1)
+        {
+            interval >>= 1;
+            bin++;
+        }
+        if (++s->interval[bin] == UINT16_MAX)
+        {
+            for (uint8_t i = 0; i < XINPUT_STATS_BINS; i++)
+                s->interval[i] >>= 1;
+        }
+    }
+    s->last_report = now;
+}
+
+//Copies the telemetry of a pad. Returns 0 if no pad is allocated to it.
+uint8_t usbh_xinput_get_stats(usbh_xinput_t *xinput, xinput_stats_report_t *report)
+{
+    if (xinput->bAddress == 0)
+    {
+        return 0;
+    }
+    uint32_t now = millis();
+    xinput_stats_t *s = &xinput->stats;
+    uint32_t elapsed = now - s->rate_start;
+    report->stats = *s;
+    report->age_ms = now - s->last_report;
+    report->reports_per_s = (elapsed) ? (s->in_reports - s->rate_reports) * 1000UL / elapsed : 0;
+    s->rate_reports = s->in_reports;
+    s->rate_start = now;
+    return 1;
+}
+#endif
+
+//CRC-16 of an IN report, skipping a byte that changes on every report.
+static uint16_t xinput_report_digest(const uint8_t *data, uint16_t len, uint8_t skip)
+{
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < len; i++)
+    {
+        if (i != skip)
+            crc = _crc_ccitt_update(crc, data[i]);
+    }
+    return _crc_ccitt_update(crc, len);
+}
+
 usbh_xinput_t *XINPUT::alloc_xinput_device(uint8_t bAddress, uint8_t itf_num, EpInfo *in, EpInfo *out, xinput_type_t type)
 {
     usbh_xinput_t *new_xinput = NULL;
@@ -57,47 +214,56 @@ usbh_xinput_t *XINPUT::alloc_xinput_device(uint8_t bAddress, uint8_t itf_num, Ep
     new_xinput->bAddress = bAddress;
     new_xinput->itf_num = itf_num;
     new_xinput->type = type;
+    new_xinput->driver = xinput_get_driver(type);
     new_xinput->usbh_inPipe = in;
     new_xinput->usbh_outPipe = out;
     new_xinput->led_requested = index + 1;
     new_xinput->chatpad_led_requested = CHATPAD_GREEN;
+    //Offset each slot's maintenance cycle so pads on the same receiver don't line up
+    new_xinput->timer_periodic = millis() - index * (XINPUT_MAINT_PERIOD_MS / XINPUT_MAXGAMEPADS);
+#ifdef ENABLE_USBH_XINPUT_STATS
+    new_xinput->stats.last_report = millis();
+    new_xinput->stats.rate_start = millis();
+#endif
+    set_ep_slot(in, index);
+    set_ep_slot(out, index);
 
     if (new_xinput->type == XBOX360_WIRELESS)
     {
-        WritePacket(new_xinput, xbox360w_controller_info, sizeof(xbox360w_controller_info), TRANSFER_PGM);
-        WritePacket(new_xinput, xbox360w_unknown, sizeof(xbox360w_unknown), TRANSFER_PGM);
-        WritePacket(new_xinput, xbox360w_rumble_enable, sizeof(xbox360w_rumble_enable), TRANSFER_PGM);
+        WritePacket(new_xinput, xbox360w_controller_info, sizeof(xbox360w_controller_info), TRANSFER_PGM, 0);
+        WritePacket(new_xinput, xbox360w_unknown, sizeof(xbox360w_unknown), TRANSFER_PGM, 0);
+        WritePacket(new_xinput, xbox360w_rumble_enable, sizeof(xbox360w_rumble_enable), TRANSFER_PGM, 0);
     }
     else if (new_xinput->type == XBOX360_WIRED)
     {
         uint8_t cmd[sizeof(xbox360_wired_led)];
-        memcpy(cmd, xbox360_wired_led, sizeof(xbox360_wired_led));
+        memcpy_P(cmd, xbox360_wired_led, sizeof(xbox360_wired_led));
         cmd[2] = index + 2;
-        pUsb->outTransfer(bAddress, out->epAddr, sizeof(xbox360_wired_led), cmd);
+        WritePacket(new_xinput, cmd, sizeof(xbox360_wired_led), 0, 0);
     }
     else if (new_xinput->type == XBOXONE)
     {
-        WritePacket(new_xinput, xboxone_start_input, sizeof(xboxone_start_input), TRANSFER_PGM);
+        WritePacket(new_xinput, xboxone_start_input, sizeof(xboxone_start_input), TRANSFER_PGM, 0);
 
         //Init packet for XBONE S/Elite controllers (return from bluetooth mode)
         if (VID == 0x045e && (PID == 0x02ea || PID == 0x0b00))
         {
-            WritePacket(new_xinput, xboxone_s_init, sizeof(xboxone_s_init), TRANSFER_PGM);
+            WritePacket(new_xinput, xboxone_s_init, sizeof(xboxone_s_init), TRANSFER_PGM, 0);
         }
 
         //Required for PDP aftermarket controllers
         if (VID == 0x0e6f)
         {
-            WritePacket(new_xinput, xboxone_pdp_init1, sizeof(xboxone_pdp_init1), TRANSFER_PGM);
-            WritePacket(new_xinput, xboxone_pdp_init2, sizeof(xboxone_pdp_init2), TRANSFER_PGM);
-            WritePacket(new_xinput, xboxone_pdp_init3, sizeof(xboxone_pdp_init3), TRANSFER_PGM);
+            WritePacket(new_xinput, xboxone_pdp_init1, sizeof(xboxone_pdp_init1), TRANSFER_PGM, 0);
+            WritePacket(new_xinput, xboxone_pdp_init2, sizeof(xboxone_pdp_init2), TRANSFER_PGM, 0);
+            WritePacket(new_xinput, xboxone_pdp_init3, sizeof(xboxone_pdp_init3), TRANSFER_PGM, 0);
         }
         
         //Required for PowerA aftermarket controllers
         if (VID == 0x24c6)
         {
-            WritePacket(new_xinput, xboxone_powera_init1, sizeof(xboxone_powera_init1), TRANSFER_PGM);
-            WritePacket(new_xinput, xboxone_powera_init2, sizeof(xboxone_powera_init2), TRANSFER_PGM);
+            WritePacket(new_xinput, xboxone_powera_init1, sizeof(xboxone_powera_init1), TRANSFER_PGM, 0);
+            WritePacket(new_xinput, xboxone_powera_init2, sizeof(xboxone_powera_init2), TRANSFER_PGM, 0);
         }
     }
     else if (new_xinput->type == XINPUT_MOUSE || new_xinput->type == XINPUT_KEYBOARD)
@@ -123,6 +289,8 @@ uint8_t XINPUT::free_xinput_device(usbh_xinput_t *xinput)
     {
         if (&xinput_devices[index] == xinput)
         {
+            set_ep_slot(xinput->usbh_inPipe, XINPUT_SLOT_NONE);
+            set_ep_slot(xinput->usbh_outPipe, XINPUT_SLOT_NONE);
             memset(xinput, 0, sizeof(usbh_xinput_t));
             USBH_XINPUT_DEBUG(F("USBH XINPUT: FREED XINPUT\n"));
             return 1;
@@ -131,97 +299,600 @@ uint8_t XINPUT::free_xinput_device(usbh_xinput_t *xinput)
     return 0;
 }
 
+void XINPUT::set_ep_slot(EpInfo *ep, uint8_t slot)
+{
+    if (num_pipes && ep >= &epInfo[0] && ep < &epInfo[num_pipes])
+    {
+        ep_slot[ep - epInfo] = slot;
+        ep_backoff[ep - epInfo] = 0;
+    }
+}
+
+//Interrupt endpoints are only serviced once every bInterval ms. An endpoint that is due but idle
+//is kept due at the current time so the 16 bit timer can't wrap.
+bool XINPUT::ep_due(uint8_t pipe, uint16_t now)
+{
+    if ((int16_t)(now - ep_next[pipe]) < 0)
+    {
+        return false;
+    }
+    ep_next[pipe] = now;
+    return true;
+}
+
+void XINPUT::ep_schedule(EpInfo *ep)
+{
+    if (num_pipes && ep >= &epInfo[0] && ep < &epInfo[num_pipes])
+    {
+        ep_next[ep - epInfo] = (uint16_t)millis() + ep_period(ep - epInfo);
+    }
+}
+
+uint16_t XINPUT::ep_period(uint8_t pipe)
+{
+    uint16_t period = (uint16_t)ep_interval[pipe] << ep_backoff[pipe];
+    uint16_t limit = (ep_slot[pipe] == XINPUT_SLOT_NONE) ? XINPUT_EMPTY_POLL_MS : xinput_idle_poll_ms;
+    return max(min(period, limit), ep_interval[pipe]);
+}
+
+//Nothing new on an IN endpoint, poll it less often from the next transfer on
+void XINPUT::ep_idle(uint8_t pipe)
+{
+    if (ep_backoff[pipe] < XINPUT_BACKOFF_MAX)
+    {
+        ep_backoff[pipe]++;
+    }
+}
+
+//Starts a transfer on one of this device's interrupt endpoints and returns without waiting for it.
+//OUT data is taken from xdata, which is free again as soon as this returns. The result is handled by
+//TransferDone() once FinishTransfers() collects it, the first thing any later transfer does.
+//Enumeration, low speed devices and multi packet writes use the blocking UHS2 transfers instead.
+uint8_t XINPUT::StartTransfer(EpInfo *ep, uint8_t len, uint8_t cmd, uint8_t arg0, uint8_t arg1)
+{
+    FinishTransfers(0);
+    ep_schedule(ep);
+
+    xinput_transfer_t xfer = {this, (uint8_t)(ep - epInfo), len, cmd, {arg0, arg1}};
+    bool in = ep->dir & 0x80;
+    if (!bIsReady || bLowSpeed || (!in && len > ep->maxPktSize))
+    {
+        uint16_t nbytes = len;
+        uint8_t rcode = (in) ? pUsb->inTransfer(bAddress, ep->epAddr, &nbytes, xdata) :
+                               pUsb->outTransfer(bAddress, ep->epAddr, len, xdata);
+        TransferDone(&xfer, rcode, nbytes);
+        return rcode;
+    }
+
+    if (in)
+        usbh_sie_start_in(pUsb, bAddress, ep);
+    else
+        usbh_sie_start_out(pUsb, bAddress, ep, xdata, len);
+    xinput_xfer = xfer;
+    return hrSUCCESS;
+}
+
+//Collects the transfer in flight if it belongs to bAddress, or whichever device it is for if bAddress
+//is 0. Handling the result may start another transfer, that is collected too.
+void XINPUT::FinishTransfers(uint8_t bAddress)
+{
+    while (usbh_sie_active() && (bAddress == 0 || xinput_xfer.dev->bAddress == bAddress))
+    {
+        xinput_transfer_t xfer = xinput_xfer;
+        uint8_t len = xfer.len;
+        uint8_t rcode = usbh_sie_finish(xfer.dev->pUsb, xdata, &len);
+        xfer.dev->TransferDone(&xfer, rcode, len);
+    }
+}
+
+//Services every device from a shared transfer budget. UHS2 polls drivers in registration order, which
+//would always hand the budget to the same device first, so the starting device rotates instead and a
+//device that ran out of budget goes first next time. A device that is enumerating gets one step first.
+void XINPUT::PollAll(void)
+{
+    if (xinput_enum.dev != NULL)
+    {
+        xinput_enum.dev->EnumStep();
+    }
+
+    uint16_t now = millis();
+    uint8_t budget = XINPUT_POLL_BUDGET;
+    for (uint8_t n = 0; n < xinput_num_instances; n++)
+    {
+        uint8_t index = (xinput_rr + n) % xinput_num_instances;
+        if (!xinput_instances[index]->Service(now, &budget))
+        {
+            xinput_rr = index;
+            return;
+        }
+    }
+    if (xinput_num_instances)
+    {
+        xinput_rr = (xinput_rr + 1) % xinput_num_instances;
+    }
+}
+
+void usbh_xinput_poll(void)
+{
+    XINPUT::PollAll();
+}
+
+void usbh_xinput_finish_transfers(usbh_xinput_t *xinput)
+{
+    if (xinput != NULL && xinput->bAddress == 0)
+    {
+        return;
+    }
+    XINPUT::FinishTransfers((xinput == NULL) ? 0 : xinput->bAddress);
+}
+
+void usbh_xinput_set_idle_poll(uint8_t ms)
+{
+    xinput_idle_poll_ms = (ms) ? ms : XINPUT_IDLE_POLL_MS;
+}
+
 usbh_xinput_t *usbh_xinput_get_device_list(void)
 {
     return xinput_devices;
 }
 
 uint8_t usbh_xinput_is_chatpad_pressed(usbh_xinput_t *xinput, uint16_t code)
+{
+    if (code < 17)
+        return xinput->chatpad_keys[0] & code;
+
+    return xinput->chatpad_keys[(code >> 3) & 0x0F] & (1 << (code & 7));
+}
+
+//Each edge is only reported once
+static uint8_t xinput_chatpad_take(uint8_t *edges, uint16_t code)
+{
+    uint8_t *keys = &edges[0];
+    uint8_t mask = code;
+    if (code >= 17)
+    {
+        keys = &edges[(code >> 3) & 0x0F];
+        mask = 1 << (code & 7);
+    }
+
+    uint8_t edge = *keys & mask;
+    *keys &= ~mask;
+    return edge;
+}
+
+uint8_t usbh_xinput_was_chatpad_pressed(usbh_xinput_t *xinput, uint16_t code)
+{
+    return xinput_chatpad_take(xinput->chatpad_keys_rising, code);
+}
+
+uint8_t usbh_xinput_was_chatpad_released(usbh_xinput_t *xinput, uint16_t code)
+{
+    return xinput_chatpad_take(xinput->chatpad_keys_falling, code);
+}
+
+//Decodes the modifier mask and up to two held key codes of a chatpad report into the keymaps.
+static void xinput_chatpad_update(usbh_xinput_t *xinput, const uint8_t *report)
+{
+    uint8_t keys[XINPUT_CHATPAD_KEYMAP_BYTES] = {0};
+    keys[0] = report[0];
+    for (uint8_t i = 1; i < 3; i++)
+    {
+        if (report[i] >= 17 && report[i] < XINPUT_CHATPAD_KEYMAP_BYTES * 8)
+            keys[report[i] >> 3] |= 1 << (report[i] & 7);
+    }
+
+    for (uint8_t i = 0; i < XINPUT_CHATPAD_KEYMAP_BYTES; i++)
+    {
+        uint8_t old = xinput->chatpad_keys[i];
+        //Edges stay latched until they are read, so a tap between two reads isn't lost
+        xinput->chatpad_keys_rising[i] |= keys[i] & ~old;
+        xinput->chatpad_keys_falling[i] |= old & ~keys[i];
+        xinput->chatpad_keys[i] = keys[i];
+    }
+}
+
+//Edges are latched until usbh_xinput_ack_gamepad_edges(), so several reports decoded between two
+//reads don't overwrite each other. They can be read any number of times before that.
+//Reports without button data (chatpad, status) leave wButtons alone and so add no edges.
+static void xinput_update_edges(usbh_xinput_t *xinput)
+{
+    uint16_t old = xinput->pad_buttons_last;
+    uint16_t now = xinput->pad_state.wButtons;
+    if (now == old)
+        return;
+
+    xinput->pad_pressed |= now & ~old;
+    xinput->pad_released |= old & ~now;
+    xinput->pad_held = now & ~xinput->pad_pressed;
+    xinput->pad_buttons_last = now;
+}
+
+void usbh_xinput_ack_gamepad_edges(usbh_xinput_t *xinput)
+{
+    xinput->pad_pressed = 0;
+    xinput->pad_released = 0;
+    xinput->pad_held = xinput->pad_buttons_last;
+}
+
+uint8_t usbh_xinput_is_gamepad_pressed(usbh_xinput_t *xinput, uint16_t button_mask)
 {
     if (xinput->bAddress == 0)
         return 0;
 
-    if (code < 17 && (xinput->chatpad_state[0] & code))
-        return 1;
+    return xinput->pad_state.wButtons & button_mask;
+}
 
-    if (code < 17)
-        return 0;
+XINPUT::XINPUT(USB *p) : pUsb(p),
+                         bAddress(0),
+                         num_pipes(0),
+                         epInfo(NULL),
+                         bIsReady(false),
+                         PID(0), VID(0),
+                         dev_num_eps(1),
+                         driver(NULL)
+{
+    memset(xdata, 0x00, sizeof(xdata));
+    if (pUsb)
+    {
+        pUsb->RegisterDeviceClass(this);
+    }
+    if (xinput_num_instances < XINPUT_MAX_DEVICES)
+    {
+        xinput_instances[xinput_num_instances++] = this;
+    }
+}
+
+static xinput_type_t xinput_itf_type(const USB_INTERFACE_DESCRIPTOR *uid, uint16_t vid)
+{
+    xinput_type_t _type = XINPUT_UNKNOWN;
+    if (uid->bNumEndpoints < 1)
+        _type = XINPUT_UNKNOWN;
+    else if (uid->bInterfaceSubClass == 0x5D && //Xbox360 wireless bInterfaceSubClass
+            uid->bInterfaceProtocol == 0x81)   //Xbox360 wireless bInterfaceProtocol
+        _type = XBOX360_WIRELESS;
+    else if (uid->bInterfaceSubClass == 0x5D && //Xbox360 wired bInterfaceSubClass
+            uid->bInterfaceProtocol == 0x01)   //Xbox360 wired bInterfaceProtocol
+        _type = XBOX360_WIRED;
+    else if (uid->bInterfaceSubClass == 0x47 && //Xbone and SX bInterfaceSubClass
+            uid->bInterfaceProtocol == 0xD0)   //Xbone and SX bInterfaceProtocol
+        _type = XBOXONE;
+    else if (uid->bInterfaceClass == 0x58 &&  //XboxOG bInterfaceClass
+            uid->bInterfaceSubClass == 0x42) //XboxOG bInterfaceSubClass
+        _type = XBOXOG;
+    else if (uid->bInterfaceClass == USB_CLASS_HID &&
+             uid->bInterfaceSubClass == 1 && //Supports boot protocol
+            uid->bInterfaceProtocol  == USB_HID_PROTOCOL_KEYBOARD)
+        _type = XINPUT_KEYBOARD;
+    else if (uid->bInterfaceClass == USB_CLASS_HID &&
+            uid->bInterfaceSubClass == 1 && //Supports boot protocol
+            uid->bInterfaceProtocol  == USB_HID_PROTOCOL_MOUSE)
+        _type = XINPUT_MOUSE;
+    else if (uid->bInterfaceClass == USB_CLASS_HID &&
+            uid->bInterfaceSubClass == 0 && //Supports boot protocol
+            uid->bInterfaceProtocol  == USB_HID_PROTOCOL_NONE &&
+            vid == 0x2DC8)
+        _type = XINPUT_8BITDO_IDLE;
+
+    //Protocols can be left out of the build
+    if (xinput_get_driver(_type) == NULL)
+        _type = XINPUT_UNKNOWN;
+    return _type;
+}
+
+xinput_conf_parser::xinput_conf_parser(XINPUT *dev, uint16_t vid)
+{
+    Reset(dev, vid);
+}
 
-    if (xinput->chatpad_state[1] == code)
-        return 1;
+void xinput_conf_parser::Reset(XINPUT *dev, uint16_t vid)
+{
+    num_itfs = 0;
+    num_eps = 1;
+    malformed = false;
+    this->dev = dev;
+    this->vid = vid;
+    itf_left = 0;
+    desc_pos = 0;
+    itf = NULL;
+}
 
-    if (xinput->chatpad_state[2] == code)
-        return 1;
+static xinput_conf_parser xinput_enum_parser(NULL, 0);
 
-    return 0;
+//Descriptors can straddle packets, so each one is gathered byte by byte. Only the start of a
+//descriptor is kept, interface and endpoint descriptors fit and everything else is skipped.
+void xinput_conf_parser::Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset __attribute__((unused)))
+{
+    for (uint16_t i = 0; i < len && !malformed; i++)
+    {
+        if (desc_pos == 0)
+        {
+            desc_len = pbuf[i];
+            malformed = desc_len < 2;
+        }
+        if (desc_pos < sizeof(desc))
+        {
+            desc[desc_pos] = pbuf[i];
+        }
+        if (++desc_pos == desc_len)
+        {
+            Descriptor();
+            desc_pos = 0;
+        }
+    }
 }
 
-uint8_t usbh_xinput_was_chatpad_pressed(usbh_xinput_t *xinput, uint16_t code)
+void xinput_conf_parser::Descriptor(void)
 {
-    //Button isnt pressed anymore, Clear it from the history
-    if (usbh_xinput_is_chatpad_pressed(xinput, code) == 0)
+    if (desc[1] == USB_DESCRIPTOR_CONFIGURATION && desc_len >= sizeof(USB_CONFIGURATION_DESCRIPTOR))
+    {
+        itf_left = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR *>(desc)->bNumInterfaces;
+    }
+    else if (desc[1] == USB_DESCRIPTOR_INTERFACE && desc_len >= sizeof(USB_INTERFACE_DESCRIPTOR))
     {
-        for (uint8_t i = 0; i < 3; i++)
+        USB_INTERFACE_DESCRIPTOR *uid = reinterpret_cast<USB_INTERFACE_DESCRIPTOR *>(desc);
+        itf = NULL;
+        if (itf_left == 0)
         {
-            if (xinput->chatpad_state_old[i] == code)
-                xinput->chatpad_state_old[i] = 0x00;
+            return;
+        }
+        itf_left--;
+
+        //The endpoints of an interface go after any previous ones, if they fit
+        xinput_type_t _type = xinput_itf_type(uid, vid);
+        if (_type == XINPUT_UNKNOWN || num_eps + uid->bNumEndpoints > dev->num_pipes)
+        {
+            return;
+        }
+
+        if (_type == XBOXONE)
+        {
+            //For XBONE we only want the first interface
+            itf_left = 0;
+        }
+
+        itf = &itfs[num_itfs++];
+        itf->itf_num = uid->bInterfaceNumber;
+        itf->type = _type;
+        itf->in_pipe = 0;
+        itf->out_pipe = 0;
+        first_pipe = num_eps;
+        ep_num = 0;
+        ep_count = uid->bNumEndpoints;
+        num_eps += uid->bNumEndpoints;
+    }
+    else if (desc[1] == USB_DESCRIPTOR_ENDPOINT && desc_len >= sizeof(USB_ENDPOINT_DESCRIPTOR) &&
+             itf != NULL && ep_num < ep_count)
+    {
+        USB_ENDPOINT_DESCRIPTOR *uepd = reinterpret_cast<USB_ENDPOINT_DESCRIPTOR *>(desc);
+        uint8_t pipe = first_pipe + ep_num++;
+        if (uepd->bmAttributes != USB_TRANSFER_TYPE_INTERRUPT)
+        {
+            return;
+        }
+        dev->epInfo[pipe].epAddr = uepd->bEndpointAddress & 0x7F;
+        dev->epInfo[pipe].maxPktSize = uepd->wMaxPacketSize & 0xFF;
+        dev->epInfo[pipe].dir = uepd->bEndpointAddress & 0x80;
+        dev->ep_interval[pipe] = max(uepd->bInterval, 1);
+        if (uepd->bEndpointAddress & 0x80)
+        {
+            itf->in_pipe = pipe;
+        }
+        else
+        {
+            itf->out_pipe = pipe;
         }
-        return 0;
     }
+}
 
-    //Button is pressed, and hasnt been pressed before
-    if (xinput->chatpad_state_old[0] != code &&
-        xinput->chatpad_state_old[1] != code &&
-        xinput->chatpad_state_old[2] != code)
+//Binds the largest free run of the pipe pool, up to XBOX_MAX_ENDPOINTS pipes, so the configuration
+//descriptor can be parsed straight into it. Enumeration trims it to the pipes the device uses.
+bool XINPUT::bind_pipes(void)
+{
+    uint8_t best_base = 0, best_len = 0;
+    for (uint8_t n = 0; n <= xinput_num_instances; n++)
     {
-        for (uint8_t i = 0; i < 3; i++)
+        //A free run starts at the start of the pool or at the end of a bound one
+        XINPUT *dev = (n < xinput_num_instances) ? xinput_instances[n] : NULL;
+        if (dev != NULL && (dev == this || dev->num_pipes == 0))
+        {
+            continue;
+        }
+        uint8_t base = (dev) ? dev->pipe_base + dev->num_pipes : 0;
+        uint8_t end = XINPUT_MAX_PIPES;
+        for (uint8_t m = 0; m < xinput_num_instances; m++)
         {
-            if (xinput->chatpad_state_old[i] == 0)
+            XINPUT *other = xinput_instances[m];
+            if (other != this && other->num_pipes && other->pipe_base >= base && other->pipe_base < end)
             {
-                xinput->chatpad_state_old[i] = code;
-                return 1;
+                end = other->pipe_base;
             }
         }
+        if (end - base > best_len)
+        {
+            best_base = base;
+            best_len = end - base;
+        }
     }
-    return 0;
+
+    //The control pipe and at least one endpoint
+    if (best_len < 2)
+    {
+        return false;
+    }
+    pipe_base = best_base;
+    num_pipes = min(best_len, XBOX_MAX_ENDPOINTS);
+    epInfo = &xinput_pipe_info[pipe_base];
+    ep_slot = &xinput_pipe_slot[pipe_base];
+    ep_interval = &xinput_pipe_interval[pipe_base];
+    ep_next = &xinput_pipe_next[pipe_base];
+    ep_backoff = &xinput_pipe_backoff[pipe_base];
+    memset(epInfo, 0x00, sizeof(EpInfo) * num_pipes);
+    memset(ep_slot, XINPUT_SLOT_NONE, num_pipes);
+    return true;
 }
 
-uint8_t usbh_xinput_is_gamepad_pressed(usbh_xinput_t *xinput, uint16_t button_mask)
+void XINPUT::reset_pipes(void)
 {
-    if (xinput->bAddress == 0)
-        return 0;
+    for (uint8_t i = 1; i < num_pipes; i++)
+    {
+        epInfo[i].epAddr = 0x00;
+        epInfo[i].maxPktSize = 0;
+        epInfo[i].dir = 0;
+        epInfo[i].epAttribs = USB_TRANSFER_TYPE_INTERRUPT;
+        epInfo[i].bmNakPower = USB_NAK_NOWAIT;
+        epInfo[i].bmSndToggle = 0;
+        epInfo[i].bmRcvToggle = 0;
+        ep_interval[i] = 1;
+        ep_next[i] = millis();
+        ep_backoff[i] = 0;
+    }
+    ep_rr = 1;
+}
 
-    return xinput->pad_state.wButtons & button_mask;
+#ifndef DISABLE_USBH_XINPUT_CACHE
+//Enumeration result of one device. crc covers everything before it, so erased or half written
+//entries are ignored. Entry n is stored after a byte holding the entry to replace next.
+typedef struct __attribute__((packed))
+{
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t conf_value;
+    uint8_t num_eps;
+    uint8_t num_itfs;
+    struct __attribute__((packed))
+    {
+        uint8_t bEndpointAddress; //0 if the pipe isn't an interrupt endpoint
+        uint8_t maxPktSize;
+        uint8_t bInterval;
+    } ep[XBOX_MAX_ENDPOINTS - 1];
+    struct __attribute__((packed))
+    {
+        uint8_t itf_num;
+        uint8_t type;
+        uint8_t in_pipe;
+        uint8_t out_pipe;
+    } itf[XINPUT_CACHE_MAX_ITFS];
+    uint16_t crc;
+} xinput_cache_t;
+
+#define XINPUT_CACHE_ENTRY_ADDR(n) (XINPUT_CACHE_EEPROM_ADDR + 1 + (n) * sizeof(xinput_cache_t))
+
+static uint16_t xinput_cache_crc(const xinput_cache_t *entry)
+{
+    return xinput_report_digest((const uint8_t *)entry, sizeof(xinput_cache_t) - sizeof(entry->crc), XINPUT_DIGEST_SKIP_NONE);
 }
 
-uint8_t usbh_xinput_was_gamepad_pressed(usbh_xinput_t *xinput, uint16_t button_mask)
+static bool xinput_cache_match(const xinput_cache_t *entry, uint16_t vid, uint16_t pid, uint16_t bcdDevice)
+{
+    return entry->crc == xinput_cache_crc(entry) && entry->idVendor == vid &&
+           entry->idProduct == pid && entry->bcdDevice == bcdDevice;
+}
+#endif
+
+//Restores the endpoints and interfaces of a cached device into epInfo and layout.
+//Returns the cache slot, or XINPUT_CACHE_NONE if the device isn't cached.
+uint8_t XINPUT::cache_load(USB_DEVICE_DESCRIPTOR *udd, xinput_conf_parser *layout, uint8_t *conf_value)
 {
-    if (usbh_xinput_is_gamepad_pressed(xinput, button_mask))
+#ifndef DISABLE_USBH_XINPUT_CACHE
+    xinput_cache_t entry;
+    for (uint8_t slot = 0; slot < XINPUT_CACHE_ENTRIES; slot++)
     {
-        if ((xinput->pad_state_wButtons_old & button_mask) == 0)
+        EEPROM.get(XINPUT_CACHE_ENTRY_ADDR(slot), entry);
+        if (!xinput_cache_match(&entry, udd->idVendor, udd->idProduct, udd->bcdDevice) || entry.num_eps > num_pipes ||
+            entry.num_itfs > XINPUT_CACHE_MAX_ITFS)
         {
-            xinput->pad_state_wButtons_old |= button_mask;
-            return 1;
+            continue;
         }
+
+        for (uint8_t pipe = 1; pipe < entry.num_eps; pipe++)
+        {
+            epInfo[pipe].epAddr = entry.ep[pipe - 1].bEndpointAddress & 0x7F;
+            epInfo[pipe].dir = entry.ep[pipe - 1].bEndpointAddress & 0x80;
+            epInfo[pipe].maxPktSize = entry.ep[pipe - 1].maxPktSize;
+            ep_interval[pipe] = max(entry.ep[pipe - 1].bInterval, 1);
+        }
+        for (uint8_t i = 0; i < entry.num_itfs; i++)
+        {
+            layout->itfs[i].itf_num = entry.itf[i].itf_num;
+            layout->itfs[i].type = (xinput_type_t)entry.itf[i].type;
+            layout->itfs[i].in_pipe = (entry.itf[i].in_pipe < entry.num_eps) ? entry.itf[i].in_pipe : 0;
+            layout->itfs[i].out_pipe = (entry.itf[i].out_pipe < entry.num_eps) ? entry.itf[i].out_pipe : 0;
+        }
+        layout->num_eps = entry.num_eps;
+        layout->num_itfs = entry.num_itfs;
+        *conf_value = entry.conf_value;
+        USBH_XINPUT_DEBUG(F("USBH XINPUT: CACHED DEVICE\n"));
+        return slot;
     }
-    else
-    {
-        xinput->pad_state_wButtons_old &= ~button_mask;
-    }
-    return 0;
+#endif
+    return XINPUT_CACHE_NONE;
 }
 
-XINPUT::XINPUT(USB *p) : pUsb(p),
-                         bAddress(0),
-                         bIsReady(false),
-                         PID(0), VID(0),
-                         dev_num_eps(1)
+//Stores a fully enumerated device, over its old entry if it has one. EEPROM.put only writes bytes
+//that changed, so enumerating a known device again doesn't wear the EEPROM.
+void XINPUT::cache_save(uint16_t bcdDevice, xinput_conf_parser *layout, uint8_t conf_value)
 {
-    memset(xdata, 0x00, sizeof(xdata));
-    if (pUsb)
+#ifndef DISABLE_USBH_XINPUT_CACHE
+    if (layout->num_itfs == 0 || layout->num_itfs > XINPUT_CACHE_MAX_ITFS)
     {
-        pUsb->RegisterDeviceClass(this);
+        return;
+    }
+
+    xinput_cache_t entry;
+    memset(&entry, 0x00, sizeof(entry));
+    entry.idVendor = VID;
+    entry.idProduct = PID;
+    entry.bcdDevice = bcdDevice;
+    entry.conf_value = conf_value;
+    entry.num_eps = layout->num_eps;
+    entry.num_itfs = layout->num_itfs;
+    for (uint8_t pipe = 1; pipe < layout->num_eps; pipe++)
+    {
+        entry.ep[pipe - 1].bEndpointAddress = epInfo[pipe].epAddr | epInfo[pipe].dir;
+        entry.ep[pipe - 1].maxPktSize = epInfo[pipe].maxPktSize;
+        entry.ep[pipe - 1].bInterval = ep_interval[pipe];
+    }
+    for (uint8_t i = 0; i < layout->num_itfs; i++)
+    {
+        entry.itf[i].itf_num = layout->itfs[i].itf_num;
+        entry.itf[i].type = layout->itfs[i].type;
+        entry.itf[i].in_pipe = layout->itfs[i].in_pipe;
+        entry.itf[i].out_pipe = layout->itfs[i].out_pipe;
+    }
+    entry.crc = xinput_cache_crc(&entry);
+
+    //Its old entry, else a free one, else the next one round
+    uint8_t slot = XINPUT_CACHE_NONE;
+    xinput_cache_t old;
+    for (uint8_t i = 0; i < XINPUT_CACHE_ENTRIES; i++)
+    {
+        EEPROM.get(XINPUT_CACHE_ENTRY_ADDR(i), old);
+        if (xinput_cache_match(&old, VID, PID, bcdDevice))
+        {
+            slot = i;
+            break;
+        }
+        if (slot == XINPUT_CACHE_NONE && old.crc != xinput_cache_crc(&old))
+        {
+            slot = i;
+        }
     }
+    if (slot == XINPUT_CACHE_NONE)
+    {
+        slot = EEPROM.read(XINPUT_CACHE_EEPROM_ADDR) % XINPUT_CACHE_ENTRIES;
+        EEPROM.update(XINPUT_CACHE_EEPROM_ADDR, (slot + 1) % XINPUT_CACHE_ENTRIES);
+    }
+    EEPROM.put(XINPUT_CACHE_ENTRY_ADDR(slot), entry);
+#endif
+}
+
+void XINPUT::cache_forget(uint8_t slot)
+{
+#ifndef DISABLE_USBH_XINPUT_CACHE
+    uint16_t addr = XINPUT_CACHE_ENTRY_ADDR(slot) + sizeof(xinput_cache_t) - sizeof(uint16_t);
+    EEPROM.update(addr, EEPROM.read(addr) ^ 0xFF);
+#endif
 }
 
 uint8_t XINPUT::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed, USB_DEVICE_DESCRIPTOR* udd)
@@ -232,7 +903,10 @@ uint8_t XINPUT::Init(uint8_t parent __attribute__((unused)), uint8_t port __attr
     dev_num_eps = 1;
     iProduct = 0;
     dev_type = XINPUT_UNKNOWN;
+    driver = NULL;
     bIsReady = false;
+    bLowSpeed = lowspeed;
+    FinishTransfers(0); //Enumeration uses the control pipe
 
     //Perform some sanity checks of everything
     if (bAddress)
@@ -241,25 +915,32 @@ uint8_t XINPUT::Init(uint8_t parent __attribute__((unused)), uint8_t port __attr
         return USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE;
     }
 
+    //The device enumerating before this one gives back the pipes it doesn't use when it's done
+    FinishEnumeration();
+    if (!bind_pipes())
+    {
+        USBH_XINPUT_DEBUG(F("USBH XINPUT: NO FREE PIPES\n"));
+        return USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL;
+    }
+
     epInfo[XBOX_CONTROL_PIPE].epAddr = 0x00;
     epInfo[XBOX_CONTROL_PIPE].epAttribs = USB_TRANSFER_TYPE_CONTROL;
     epInfo[XBOX_CONTROL_PIPE].maxPktSize = udd->bMaxPacketSize0;
     epInfo[XBOX_CONTROL_PIPE].bmNakPower = USB_NAK_MAX_POWER;
     pUsb->setEpInfoEntry(bAddress, 1, epInfo);
+    reset_pipes();
 
-    for (uint8_t i = 1; i < XBOX_MAX_ENDPOINTS; i++)
-    {
-        epInfo[i].epAddr = 0x00;
-        epInfo[i].epAttribs = USB_TRANSFER_TYPE_INTERRUPT;
-        epInfo[i].bmNakPower = USB_NAK_NOWAIT;
-        epInfo[i].bmSndToggle = 0;
-        epInfo[i].bmRcvToggle = 0;
-    }
+    //Devices seen before get their endpoints from the EEPROM cache
+    xinput_conf_parser *parser = &xinput_enum_parser;
+    parser->Reset(this, udd->idVendor);
+    uint8_t conf_value = 0;
+    uint8_t cache_slot = cache_load(udd, parser, &conf_value);
 
     //Get a USB address then set it
     bAddress = addrPool.AllocAddress(parent, false, port);
     if (!bAddress)
     {
+        Release();
         USBH_XINPUT_DEBUG(F("USBH XINPUT: USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL\n"));
         return USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL;
     }
@@ -272,8 +953,6 @@ uint8_t XINPUT::Init(uint8_t parent __attribute__((unused)), uint8_t port __attr
         return rcode;
     }
 
-    delay(20); //Give time for address change
-
     //Get our new device at the address
     p = addrPool.GetUsbDevicePtr(bAddress);
     if (!p)
@@ -292,192 +971,202 @@ uint8_t XINPUT::Init(uint8_t parent __attribute__((unused)), uint8_t port __attr
     iManuf = udd->iManufacturer;
     iSerial = udd->iSerialNumber;
 
-    //Get the device descriptor at the new address
-    rcode = pUsb->getDevDescr(bAddress, 0, sizeof(USB_DEVICE_DESCRIPTOR), xdata);
-    if (rcode)
-    {
-            return rcode;
-    }
-    //Request the first 9bytes of the configuration descriptor to determine the max length
+    //The rest happens in EnumStep(), the device isn't polled until it's done
+    xinput_enum.dev = this;
+    xinput_enum.step = XINPUT_ENUM_SETTLE;
+    xinput_enum.cache_slot = cache_slot;
+    xinput_enum.conf_value = conf_value;
+    xinput_enum.bcdDevice = udd->bcdDevice;
+    xinput_enum.timer = millis();
+    return hrSUCCESS;
+}
+
+//Runs the next enumeration step of the device, at most one control transfer
+void XINPUT::EnumStep(void)
+{
+    xinput_conf_parser *parser = &xinput_enum_parser;
     USB_CONFIGURATION_DESCRIPTOR *ucd = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR *>(xdata);
-    rcode = pUsb->getConfDescr(bAddress, XBOX_CONTROL_PIPE, 9, 0, xdata);
-    if (rcode)
-    {
-        Release();
-        USBH_XINPUT_DEBUG(F("USBH XINPUT: getConfDescr error\n"));
-        return rcode;
-    }
-    //Request the full configuration descriptor to determine what xinput device it is and get endpoint info etc.
-    rcode = pUsb->getConfDescr(bAddress, XBOX_CONTROL_PIPE, ucd->wTotalLength, 0, xdata);
-    if (rcode)
-    {
-        Release();
-        USBH_XINPUT_DEBUG(F("USBH XINPUT: getConfDescr error\n"));
-        return rcode;
-    }
-    //Set the device configuration we want to use
-    rcode = pUsb->setConf(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, ucd->bConfigurationValue);
-    if (rcode)
+    uint8_t rcode = hrSUCCESS;
+    FinishTransfers(0); //Enumeration uses the control pipe
+
+    switch (xinput_enum.step)
     {
-        Release();
-        USBH_XINPUT_DEBUG(F("USBH XINPUT: setConf error\n"));
-        return rcode;
-    }
+    case XINPUT_ENUM_SETTLE:
+        //Give time for address change
+        if ((uint16_t)(millis() - xinput_enum.timer) <
+            ((xinput_enum.cache_slot != XINPUT_CACHE_NONE) ? XINPUT_CACHED_ADDRESS_MS : XINPUT_SET_ADDRESS_MS))
+        {
+            return;
+        }
+        xinput_enum.step = (xinput_enum.cache_slot != XINPUT_CACHE_NONE) ? XINPUT_ENUM_SET_CONF : XINPUT_ENUM_DEV_DESCR;
+        return;
+
+    case XINPUT_ENUM_DEV_DESCR:
+        //Get the device descriptor at the new address
+        rcode = pUsb->getDevDescr(bAddress, 0, sizeof(USB_DEVICE_DESCRIPTOR), xdata);
+        xinput_enum.step = XINPUT_ENUM_CONF_HEADER;
+        break;
+
+    case XINPUT_ENUM_CONF_HEADER:
+        //Request the first 9bytes of the configuration descriptor to determine the max length
+        rcode = pUsb->getConfDescr(bAddress, XBOX_CONTROL_PIPE, 9, 0, xdata);
+        xinput_enum.total_len = ucd->wTotalLength;
+        xinput_enum.conf_value = ucd->bConfigurationValue;
+        xinput_enum.step = XINPUT_ENUM_CONF;
+        break;
 
-    uint8_t num_itf = ucd->bNumInterfaces;
-    uint8_t *pdesc = (uint8_t *)ucd;
-    uint8_t pdesc_pos = 0;
-    USB_INTERFACE_DESCRIPTOR *uid;
-    while (num_itf)
-    {
-        //Find next interface
-        while (pdesc[1] != USB_DESCRIPTOR_INTERFACE)
+    case XINPUT_ENUM_CONF:
+        //Stream the full configuration descriptor through the parser to determine what xinput device it is and get endpoint info etc.
+        rcode = pUsb->ctrlReq(bAddress, XBOX_CONTROL_PIPE, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, 0x00,
+                              USB_DESCRIPTOR_CONFIGURATION, 0x0000, xinput_enum.total_len, sizeof(xdata), xdata, parser);
+        if (rcode == hrSUCCESS && parser->malformed)
         {
-            //Shift the pointer by bLength
-            pdesc_pos += pdesc[0];
-            if (pdesc_pos > sizeof(xdata) || pdesc_pos > ucd->wTotalLength)
-            {
-                USBH_XINPUT_DEBUG(F("USBH XINPUT: BUFFER OVERLOW PARSING INTERFACES\n"));
-                return hrBADREQ;
-            }
-            pdesc += pdesc[0];
-        }
-        uid = reinterpret_cast<USB_INTERFACE_DESCRIPTOR *>(pdesc);
-        xinput_type_t _type = XINPUT_UNKNOWN;
-        if (uid->bNumEndpoints < 1)
-            _type = XINPUT_UNKNOWN;
-        else if (uid->bInterfaceSubClass == 0x5D && //Xbox360 wireless bInterfaceSubClass
-                uid->bInterfaceProtocol == 0x81)   //Xbox360 wireless bInterfaceProtocol
-            _type = XBOX360_WIRELESS;
-        else if (uid->bInterfaceSubClass == 0x5D && //Xbox360 wired bInterfaceSubClass
-                uid->bInterfaceProtocol == 0x01)   //Xbox360 wired bInterfaceProtocol
-            _type = XBOX360_WIRED;
-        else if (uid->bInterfaceSubClass == 0x47 && //Xbone and SX bInterfaceSubClass
-                uid->bInterfaceProtocol == 0xD0)   //Xbone and SX bInterfaceProtocol
-            _type = XBOXONE;
-        else if (uid->bInterfaceClass == 0x58 &&  //XboxOG bInterfaceClass
-                uid->bInterfaceSubClass == 0x42) //XboxOG bInterfaceSubClass
-            _type = XBOXOG;
-        else if (uid->bInterfaceClass == USB_CLASS_HID &&
-                 uid->bInterfaceSubClass == 1 && //Supports boot protocol
-                uid->bInterfaceProtocol  == USB_HID_PROTOCOL_KEYBOARD)
-            _type = XINPUT_KEYBOARD;
-        else if (uid->bInterfaceClass == USB_CLASS_HID &&
-                uid->bInterfaceSubClass == 1 && //Supports boot protocol
-                uid->bInterfaceProtocol  == USB_HID_PROTOCOL_MOUSE)
-            _type = XINPUT_MOUSE;
-        else if (uid->bInterfaceClass == USB_CLASS_HID &&
-                uid->bInterfaceSubClass == 0 && //Supports boot protocol
-                uid->bInterfaceProtocol  == USB_HID_PROTOCOL_NONE &&
-                VID == 0x2DC8)
-            _type = XINPUT_8BITDO_IDLE;
-
-        if (_type == XINPUT_UNKNOWN)
-        {
-            num_itf--;
-            pdesc += pdesc[0];
-            continue;
+            rcode = hrBADREQ;
         }
+        xinput_enum.step = XINPUT_ENUM_SET_CONF;
+        break;
 
-        if (_type == XBOXONE)
+    case XINPUT_ENUM_SET_CONF:
+        //Set the device configuration we want to use
+        rcode = pUsb->setConf(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, xinput_enum.conf_value);
+        if (rcode && xinput_enum.cache_slot != XINPUT_CACHE_NONE)
         {
-            //For XBONE we only want the first interface
-            num_itf = 1;
+            //Not the device that was cached after all, enumerate it in full
+            USBH_XINPUT_DEBUG(F("USBH XINPUT: cached setConf error\n"));
+            cache_forget(xinput_enum.cache_slot);
+            xinput_enum.cache_slot = XINPUT_CACHE_NONE;
+            reset_pipes();
+            parser->Reset(this, VID);
+            xinput_enum.step = XINPUT_ENUM_DEV_DESCR;
+            return;
+        }
+        if (rcode)
+        {
+            break;
+        }
+        if (xinput_enum.cache_slot == XINPUT_CACHE_NONE)
+        {
+            cache_save(xinput_enum.bcdDevice, parser, xinput_enum.conf_value);
         }
 
-        USBH_XINPUT_DEBUG(F("USBH XINPUT: XID TYPE: "));
-        USBH_XINPUT_DEBUG(_type);
+        USBH_XINPUT_DEBUG(F("USBH XINPUT: Found valid EPs "));
+        USBH_XINPUT_DEBUG(parser->num_eps);
         USBH_XINPUT_DEBUG("\n");
-
-        //Parse the configuration descriptor to find the two endpoint addresses (Only used for non wireless receiver)
-        uint8_t cd_len = 0, cd_type = 0, cd_pos = 0, ep_num = 0;
-        EpInfo *ep_in, *ep_out = NULL;
-        while (ep_num < uid->bNumEndpoints)
+        if (parser->num_eps < 2)
         {
-            if (cd_pos >= sizeof(xdata) - 1)
-                break;
+            USBH_XINPUT_DEBUG(F("USBH XINPUT: NO VALID XINPUTS\n"));
+            rcode = USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+            break;
+        }
 
-            uint8_t *pepdesc = (uint8_t *)uid;
+        //Update the device EP table with the endpoints of every supported interface, the rest of
+        //the pipes go back to the pool
+        dev_num_eps = parser->num_eps;
+        num_pipes = dev_num_eps;
+        rcode = pUsb->setEpInfoEntry(bAddress, dev_num_eps, epInfo);
+        xinput_enum.next_itf = 0;
+        xinput_enum.step = XINPUT_ENUM_INQUIRE;
+        break;
 
-            cd_len = pepdesc[cd_pos];
-            cd_type = pepdesc[cd_pos + 1];
-            if (cd_type == USB_ENDPOINT_DESCRIPTOR_TYPE)
+    case XINPUT_ENUM_INQUIRE:
+        //For the wireless receiver send an inquire packet to each endpoint (Even endpoints only), one per step
+        while (xinput_enum.next_itf < parser->num_itfs)
+        {
+            xinput_itf_t *itf = &parser->itfs[xinput_enum.next_itf++];
+            if (itf->type == XBOX360_WIRELESS && itf->in_pipe && itf->out_pipe)
             {
-                USB_ENDPOINT_DESCRIPTOR *uepd = reinterpret_cast<USB_ENDPOINT_DESCRIPTOR *>(&pdesc[cd_pos]);
-                if (uepd->bmAttributes == USB_TRANSFER_TYPE_INTERRUPT)
-                {
-                    uint8_t pipe = ep_num + dev_num_eps; //Register it after any previous endpoints
-                    epInfo[pipe].epAddr = uepd->bEndpointAddress & 0x7F;
-                    epInfo[pipe].maxPktSize = uepd->wMaxPacketSize & 0xFF;
-                    epInfo[pipe].dir = uepd->bEndpointAddress & 0x80;
-                    if (uepd->bEndpointAddress & 0x80)
-                    {
-                        ep_in = &epInfo[pipe];
-                    }
-                    else
-                    {
-                        ep_out = &epInfo[pipe];
-                    }
-                }
-                ep_num++;
+                memcpy_P(xdata, xbox360w_inquire_present, sizeof(xbox360w_inquire_present));
+                pUsb->outTransfer(bAddress, epInfo[itf->out_pipe].epAddr, sizeof(xbox360w_inquire_present), xdata);
+                return;
             }
-            cd_pos += cd_len;
         }
+        xinput_enum.next_itf = 0;
+        xinput_enum.step = (iProduct) ? XINPUT_ENUM_PRODUCT_LEN : XINPUT_ENUM_ALLOC;
+        return;
 
-        dev_num_eps += uid->bNumEndpoints;
-        //Update the device EP table with the latest interface
-        rcode = pUsb->setEpInfoEntry(bAddress, dev_num_eps, epInfo);
-        if (rcode)
+    case XINPUT_ENUM_PRODUCT_LEN:
+        //Hack, Retroflag controller needs a product string request on enumeration to work.
+        rcode = pUsb->getStrDescr(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, 2, iProduct, 0x0409, xdata);
+        xinput_enum.product_len = (rcode == hrSUCCESS && xdata[1] == USB_DESCRIPTOR_STRING) ? xdata[0] : 0;
+        xinput_enum.step = (xinput_enum.product_len) ? XINPUT_ENUM_PRODUCT : XINPUT_ENUM_ALLOC;
+        return;
+
+    case XINPUT_ENUM_PRODUCT:
+        pUsb->getStrDescr(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, min(xinput_enum.product_len, sizeof(xdata)), iProduct, 0x0409, xdata);
+        xinput_enum.step = XINPUT_ENUM_ALLOC;
+        return;
+
+    case XINPUT_ENUM_ALLOC:
+        //One interface per step. Allocating a pad sends its init packets, and a SET_PROTOCOL control
+        //transfer for a keyboard or mouse.
+        while (xinput_enum.next_itf < parser->num_itfs)
         {
-            Release();
-            USBH_XINPUT_DEBUG(F("USBH XINPUT: setEpInfoEntry error\n"));
-            return rcode;
-        }
+            xinput_itf_t *itf = &parser->itfs[xinput_enum.next_itf++];
+            USBH_XINPUT_DEBUG(F("USBH XINPUT: XID TYPE: "));
+            USBH_XINPUT_DEBUG(itf->type);
+            USBH_XINPUT_DEBUG("\n");
+            if (itf->in_pipe == 0)
+            {
+                continue;
+            }
 
-        //Wired we can allocate immediately.
-        if (_type != XBOX360_WIRELESS)
-        {
-            alloc_xinput_device(bAddress, uid->bInterfaceNumber, ep_in, ep_out, _type);
-        }
-        else
-        {
-            //For the wireless controller send an inquire packet to each endpoint (Even endpoints only)
+            //Wired we can allocate immediately. Wireless pads are allocated when they connect,
+            //until then the receiver parses the reports.
+            if (itf->type != XBOX360_WIRELESS)
+            {
+                alloc_xinput_device(bAddress, itf->itf_num, &epInfo[itf->in_pipe],
+                                    (itf->out_pipe) ? &epInfo[itf->out_pipe] : NULL, itf->type);
+                return;
+            }
             dev_type = XBOX360_WIRELESS;
-            uint8_t cmd[sizeof(xbox360w_inquire_present)];
-            memcpy_P(cmd, xbox360w_inquire_present, sizeof(xbox360w_inquire_present));
-            pUsb->outTransfer(bAddress, ep_out->epAddr, sizeof(xbox360w_inquire_present), cmd);
+            driver = xinput_get_driver(XBOX360_WIRELESS);
         }
-        num_itf--;
-        pdesc += pdesc[0];
+        xinput_enum.step = XINPUT_ENUM_DONE;
+        return;
+
+    case XINPUT_ENUM_DONE:
+        xinput_enum.dev = NULL;
+        bIsReady = true;
+        USBH_XINPUT_DEBUG(F("USBH XINPUT: ENUMERATED OK!\n"));
+        return;
     }
 
-    //Hack, Retroflag controller needs a product string request on enumeration to work.
-    if (iProduct)
+    if (rcode)
     {
-        rcode = pUsb->getStrDescr(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, 2, iProduct, 0x0409, xdata);
-        if (rcode == hrSUCCESS && xdata[1] == USB_DESCRIPTOR_STRING)
-        {
-            pUsb->getStrDescr(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, min(xdata[0], sizeof(xdata)), iProduct, 0x0409, xdata);
-        }
+        USBH_XINPUT_DEBUG(F("USBH XINPUT: ENUMERATION FAILED, STEP "));
+        USBH_XINPUT_DEBUG(xinput_enum.step);
+        USBH_XINPUT_DEBUG("\n");
+        //Init() already returned success, so UHS2 won't reset the port and the device keeps answering
+        //at bAddress. Hold on to the address until it is unplugged and Release() is called, only the
+        //endpoint pipes go back to the pool.
+        xinput_enum.dev = NULL;
+        dev_num_eps = 1;
+        num_pipes = 1;
+        pUsb->setEpInfoEntry(bAddress, 1, epInfo);
     }
+}
 
-    USBH_XINPUT_DEBUG(F("USBH XINPUT: Found valid EPs "));
-    USBH_XINPUT_DEBUG(dev_num_eps);
-    USBH_XINPUT_DEBUG("\n");
-    if (dev_num_eps < 2)
+//Runs the enumeration in progress to completion, for when the control pipe is needed by a new device.
+void XINPUT::FinishEnumeration(void)
+{
+    while (xinput_enum.dev != NULL)
     {
-        Release();
-        USBH_XINPUT_DEBUG(F("USBH XINPUT: NO VALID XINPUTS\n"));
-        return USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+        if (xinput_enum.step == XINPUT_ENUM_SETTLE)
+        {
+            delay(1);
+        }
+        xinput_enum.dev->EnumStep();
     }
-
-    bIsReady = true;
-    USBH_XINPUT_DEBUG(F("USBH XINPUT: ENUMERATED OK!\n"));
-    return hrSUCCESS;
 }
 
 uint8_t XINPUT::Release()
 {
+    FinishTransfers(bAddress);
+    if (xinput_enum.dev == this)
+    {
+        xinput_enum.dev = NULL;
+    }
+
     uint8_t index;
     for (index = 0; index < XINPUT_MAXGAMEPADS; index++)
     {
@@ -489,51 +1178,82 @@ uint8_t XINPUT::Release()
     }
 
     pUsb->GetAddressPool().FreeAddress(bAddress);
-    memset(epInfo, 0x00, sizeof(EpInfo) * XBOX_MAX_ENDPOINTS);
+    if (num_pipes)
+    {
+        memset(epInfo, 0x00, sizeof(EpInfo) * num_pipes);
+        memset(ep_slot, XINPUT_SLOT_NONE, num_pipes);
+        num_pipes = 0;
+    }
     bAddress = 0;
     bIsReady = false;
     return 0;
 }
 
+//Output commands that differ from the state the pad acknowledged. Rumble and led values are only
+//read when the command is sent, so repeated requests coalesce into one transfer of the latest value.
+static uint8_t xinput_out_pending(usbh_xinput_t *xinput)
+{
+    uint8_t pending = 0;
+    if (xinput->lValue_requested != xinput->lValue_actual || xinput->rValue_requested != xinput->rValue_actual)
+        pending |= XINPUT_OUT_RUMBLE;
+    if (xinput->led_requested != xinput->led_actual)
+        pending |= XINPUT_OUT_LED;
+    if (xinput->type != XBOX360_WIRELESS)
+        return pending;
+    if (xinput->chatpad_initialised == 0)
+        pending |= XINPUT_OUT_CHATPAD_INIT;
+    if (xinput->chatpad_led_requested != xinput->chatpad_led_actual)
+        pending |= XINPUT_OUT_CHATPAD_LED;
+    //Hold the Xbox button to power off the controller
+    if ((xinput->pad_state.wButtons & XINPUT_GAMEPAD_XBOX_BUTTON) && (millis() - xinput->timer_poweroff) > 1000)
+        pending |= XINPUT_OUT_POWER_OFF;
+    //Finish a maintenance cycle once it has started
+    if (xinput->maint_step != 0 || millis() - xinput->timer_periodic > XINPUT_MAINT_PERIOD_MS)
+        pending |= XINPUT_OUT_MAINTENANCE;
+    return pending;
+}
+
+//Endpoints are serviced from usbh_xinput_poll() so all devices share one transfer budget.
 uint8_t XINPUT::Poll()
 {
-    uint16_t len;
-    uint8_t rcode;
+    return 0;
+}
 
+//Services the endpoints on this device that are due, starting where the last call ran out of budget.
+//Transfers are left running when this returns, their results are handled the next time the MAX3421E
+//is needed, see StartTransfer(). Returns false if the budget ran out.
+bool XINPUT::Service(uint16_t now, uint8_t *budget)
+{
     if (!bIsReady)
-        return 0;
+        return true;
 
-    //Read all endpoints on this device, and parse into the xinput linked list as required.
-    for (uint8_t i = 1; i < dev_num_eps; i++)
+    uint8_t maint_budget = XINPUT_MAINT_BUDGET;
+    uint8_t eps_to_scan = dev_num_eps - 1; //Every endpoint but the control pipe
+    for (uint8_t n = 0; n < eps_to_scan; n++)
     {
-        //Find the xinput struct this endpoint belongs to. If its not yet initialised, it will return NULL.
-        usbh_xinput_t *xinput = NULL;
-        for (uint8_t index = 0; index < XINPUT_MAXGAMEPADS; index++)
+        uint8_t i = 1 + (ep_rr - 1 + n) % eps_to_scan;
+        if (!ep_due(i, now))
         {
-            if (xinput_devices[index].bAddress == 0)
-            {
-                continue;
-            }
-
-            if (xinput_devices[index].usbh_inPipe == &epInfo[i] || xinput_devices[index].usbh_outPipe == &epInfo[i])
-            {
-                xinput = &xinput_devices[index];
-                break;
-            }
+            continue;
+        }
+        if (*budget == 0)
+        {
+            ep_rr = i;
+            return false;
         }
 
+        //The transfer in flight may connect or disconnect a pad, so collect it first.
+        FinishTransfers(0);
+
+        //Find the xinput struct this endpoint belongs to. If its not yet initialised, it will be NULL.
+        usbh_xinput_t *xinput = (ep_slot[i] == XINPUT_SLOT_NONE) ? NULL : &xinput_devices[ep_slot[i]];
+
         //Read the in endpoints. For xbox wireless, the controller may not be allocated yet, so
-        //read on all odd endpoints too.
+        //read on all odd endpoints too. The report is parsed in TransferDone().
         if (epInfo[i].dir & 0x80)
         {
-            len = min(epInfo[i].maxPktSize, EP_MAXPKTSIZE);
-            uint8_t epaddr = (xinput == NULL) ? epInfo[i].epAddr : xinput->usbh_inPipe->epAddr;
-            rcode = pUsb->inTransfer(bAddress, epaddr, &len, xdata);
-            if (rcode == hrSUCCESS)
-            {
-                ParseInputData(&xinput, &epInfo[i]);
-            }
-            //This is an in pipe, so we're done in this loop.
+            StartTransfer(&epInfo[i], min(epInfo[i].maxPktSize, EP_MAXPKTSIZE));
+            (*budget)--;
             continue;
         }
 
@@ -543,80 +1263,75 @@ uint8_t XINPUT::Poll()
             continue;
         }
 
-        //Don't spam output. 20ms is ok for now. (FIXME: Should be bInterval)
-        if (millis() - xinput->timer_out < 20)
+        if (xinput->usbh_outPipe->epAddr == 0x00)
         {
             continue;
         }
 
-        if (xinput->usbh_outPipe->epAddr == 0x00)
+        //One command per OUT interval. The command sent last steps aside if anything else is
+        //waiting, so a rumble motor that changes every frame can't starve the leds.
+        uint8_t pending = xinput_out_pending(xinput);
+        if (maint_budget == 0)
         {
-            continue;
+            pending &= ~XINPUT_OUT_MAINTENANCE;
+        }
+        if (pending & ~xinput->out_last)
+        {
+            pending &= ~xinput->out_last;
+        }
+        uint8_t cmd = pending & -pending; //Highest priority is the lowest bit
+        xinput->out_last = cmd;
+        if (cmd)
+        {
+            (*budget)--;
         }
 
-        //Send rumble
-        if (xinput->lValue_requested != xinput->lValue_actual || xinput->rValue_requested != xinput->rValue_actual)
+        if (cmd == XINPUT_OUT_RUMBLE)
         {
             USBH_XINPUT_DEBUG(F("SET RUMBLE\n"));
             SetRumble(xinput, xinput->lValue_requested, xinput->rValue_requested);
         }
-
-        //Send LED commands
-        else if (xinput->led_requested != xinput->led_actual)
+        else if (cmd == XINPUT_OUT_LED)
         {
             USBH_XINPUT_DEBUG(F("USBH XINPUT: SET LED\n"));
             SetLed(xinput, xinput->led_requested);
         }
-
-        //Handle chatpad initialisation (Wireless 360 controller only)
-        else if (xinput->type == XBOX360_WIRELESS && xinput->chatpad_initialised == 0)
+        else if (cmd == XINPUT_OUT_CHATPAD_INIT)
         {
             USBH_XINPUT_DEBUG(F("USBH XINPUT: SENDING CHATPAD INIT PACKET\n"));
-            WritePacket(xinput, xbox360w_chatpad_init, sizeof(xbox360w_chatpad_init), TRANSFER_PGM);
-            xinput->chatpad_initialised = 1;
+            memcpy_P(xdata, xbox360w_chatpad_init, sizeof(xbox360w_chatpad_init));
+            StartTransfer(&epInfo[i], sizeof(xbox360w_chatpad_init), XINPUT_OUT_CHATPAD_INIT);
         }
-
-        //Handle chatpad leds (Wireless 360 controller only)
-        else if (xinput->type == XBOX360_WIRELESS && xinput->chatpad_led_requested != xinput->chatpad_led_actual)
+        else if (cmd == XINPUT_OUT_CHATPAD_LED)
         {
-            memcpy_P(xdata, xbox360w_chatpad_led_ctrl, sizeof(xbox360w_chatpad_led_ctrl));
+            //One led per command, the chatpad reports its led state back so chatpad_led_actual is corrected if it was lost.
+            //The keepalive stays on its own maintenance slot, the remaining leds go out as later commands.
             for (uint8_t led = 0; led < 4; led++)
             {
-                uint8_t actual = xinput->chatpad_led_actual & pgm_read_byte(&chatpad_mod[led]);
-                uint8_t want = xinput->chatpad_led_requested & pgm_read_byte(&chatpad_mod[led]);
-                //The user has requested a led to turn on that isnt already on
-                if (!actual && want)
-                {
-                    xdata[3] = pgm_read_byte(&chatpad_led_on[led]);
-                    xinput->chatpad_led_actual |= pgm_read_byte(&chatpad_mod[led]);
-                }
-                //The user has requested a led to turn off that isnt already off
-                else if (actual && !want)
+                uint8_t mod = pgm_read_byte(&chatpad_mod[led]);
+                uint8_t actual = xinput->chatpad_led_actual & mod;
+                uint8_t want = xinput->chatpad_led_requested & mod;
+                if (actual == want)
                 {
-                    xdata[3] = pgm_read_byte(&chatpad_led_off[led]);
-                    xinput->chatpad_led_actual &= ~pgm_read_byte(&chatpad_mod[led]);
-                }
-                else
-                {
-                    //No change, check next chatpad led
                     continue;
                 }
                 USBH_XINPUT_DEBUG(F("USBH XINPUT: SET CHATPAD LED\n"));
-                pUsb->outTransfer(bAddress, epInfo[i].epAddr, sizeof(xbox360w_chatpad_led_ctrl), xdata);
-                xinput->timer_out = millis();
-                xinput->timer_periodic -= 2000; //Force chatpad keep alive packet check
+                memcpy_P(xdata, xbox360w_chatpad_led_ctrl, sizeof(xbox360w_chatpad_led_ctrl));
+                xdata[3] = (want) ? pgm_read_byte(&chatpad_led_on[led]) : pgm_read_byte(&chatpad_led_off[led]);
+                StartTransfer(&epInfo[i], sizeof(xbox360w_chatpad_led_ctrl), XINPUT_OUT_CHATPAD_LED, mod, want);
+                break;
             }
         }
-
-        //Handle controller power off, Hold Xbox button. (Wireless 360 controller only)
-        else if (xinput->type == XBOX360_WIRELESS && xinput->pad_state.wButtons & XINPUT_GAMEPAD_XBOX_BUTTON)
+        else if (cmd == XINPUT_OUT_POWER_OFF)
         {
-            if ((millis() - xinput->timer_poweroff) > 1000)
-            {
-                USBH_XINPUT_DEBUG(F("USBH XINPUT: POWERING OFF CONTROLLER\n"));
-                WritePacket(xinput, xbox360w_power_off, sizeof(xbox360w_power_off), TRANSFER_PGM);
-                xinput->timer_poweroff = millis();
-            }
+            USBH_XINPUT_DEBUG(F("USBH XINPUT: POWERING OFF CONTROLLER\n"));
+            WritePacket(xinput, xbox360w_power_off, sizeof(xbox360w_power_off), TRANSFER_PGM, XINPUT_OUT_POWER_OFF);
+            xinput->timer_poweroff = millis();
+        }
+        else if (cmd == XINPUT_OUT_MAINTENANCE)
+        {
+            maint_budget--;
+            SendMaintenance(xinput);
         }
 
         //Reset xbox button hold timer (Wireless 360 only)
@@ -625,297 +1340,428 @@ uint8_t XINPUT::Poll()
             xinput->timer_poweroff = millis();
         }
 
-        //Handle background periodic writes
-        if (millis() - xinput->timer_periodic > 1000)
+    }
+
+    return true;
+}
+
+//Result of a transfer from StartTransfer(). The pad is looked up again as the endpoint may have
+//changed hands while the transfer was running.
+void XINPUT::TransferDone(const xinput_transfer_t *xfer, uint8_t rcode, uint8_t len)
+{
+    EpInfo *ep = &epInfo[xfer->pipe];
+    usbh_xinput_t *xinput = (ep_slot[xfer->pipe] == XINPUT_SLOT_NONE) ? NULL : &xinput_devices[ep_slot[xfer->pipe]];
+#ifdef ENABLE_USBH_XINPUT_STATS
+    if (xinput != NULL)
+        xinput_stats_count(xinput, xfer, ep->dir & 0x80, rcode);
+#endif
+    if (rcode != hrSUCCESS)
+    {
+        //A NAK on an IN endpoint means nothing changed. A failed OUT command is retried on the next OUT interval.
+        if (ep->dir & 0x80)
+            ep_idle(xfer->pipe);
+        return;
+    }
+
+    if (!(ep->dir & 0x80))
+    {
+        if (xinput == NULL)
         {
-            //USBH_XINPUT_DEBUG(F("USBH XINPUT: BACKGROUND POLL\n"));
-            if (xinput->type == XBOX360_WIRELESS)
-            {
-                WritePacket(xinput, xbox360w_inquire_present, sizeof(xbox360w_inquire_present), TRANSFER_PGM);
-                WritePacket(xinput, xbox360w_controller_info, sizeof(xbox360w_controller_info), TRANSFER_PGM);
-                SetLed(xinput, xinput->led_requested);
-                (xinput->chatpad_keepalive_toggle ^= 1) ? \
-                    WritePacket(xinput, xbox360w_chatpad_keepalive1, sizeof(xbox360w_chatpad_keepalive1), TRANSFER_PGM) :
-                    WritePacket(xinput, xbox360w_chatpad_keepalive2, sizeof(xbox360w_chatpad_keepalive2), TRANSFER_PGM);
-            }
-            xinput->timer_periodic = millis();
+            return;
+        }
+        switch (xfer->cmd)
+        {
+        case XINPUT_OUT_RUMBLE:
+            xinput->lValue_actual = xfer->arg[0];
+            xinput->rValue_actual = xfer->arg[1];
+            break;
+        case XINPUT_OUT_LED:
+            xinput->led_actual = xfer->arg[0];
+            break;
+        case XINPUT_OUT_CHATPAD_INIT:
+            xinput->chatpad_initialised = 1;
+            break;
+        case XINPUT_OUT_CHATPAD_LED:
+            xinput->chatpad_led_actual = (xinput->chatpad_led_actual & ~xfer->arg[0]) | xfer->arg[1];
+            break;
         }
+        return;
     }
 
-    return 0;
+#ifdef ENABLE_USBH_XINPUT_CAPTURE
+    CaptureInputData(bAddress, ep->epAddr, (xinput == NULL) ? dev_type : xinput->type, xdata, len);
+#endif
+    const xinput_driver_t *drv = (xinput == NULL) ? driver : xinput->driver;
+    if (drv == NULL)
+    {
+        return;
+    }
+
+    //Idle pads keep resending the same report, only decode it if it changed.
+    //Nothing has been decoded while state_seq is 0, so don't trust the digest then.
+    if (xinput != NULL)
+    {
+        uint16_t digest = xinput_report_digest(xdata, len, pgm_read_byte(&drv->digest_skip));
+        if (digest == xinput->report_digest && xinput->state_seq != 0)
+        {
+            ep_idle(xfer->pipe);
+            return;
+        }
+        xinput->report_digest = digest;
+    }
+
+    xinput_parse_t parse = (xinput_parse_t)pgm_read_ptr(&drv->parse);
+    if (parse(this, &xinput, ep, xdata, len) && xinput != NULL)
+    {
+        xinput_update_edges(xinput);
+        xinput->state_seq++;
+        //Fresh input, back to bInterval for the next report
+        ep_backoff[xfer->pipe] = 0;
+        ep_next[xfer->pipe] = (uint16_t)millis() + ep_interval[xfer->pipe];
+    }
 }
 
-bool XINPUT::ParseInputData(usbh_xinput_t **xpad, EpInfo *ep_in)
-{
+//Protocol handlers. Each supported xinput_type_t has a struct of static handlers, xinput_driver<P>
+//turns it into a PROGMEM dispatch table. Only protocols returned by xinput_get_driver() are
+//instantiated, so the DISABLE_USBH_x build flags drop their code and tables from the binary.
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wstrict-aliasing"
 
-    uint16_t wButtons;
-    usbh_xinput_t *_xpad = *xpad;
+template <class P>
+struct xinput_driver
+{
+    static const xinput_driver_t table;
+};
+
+template <class P>
+const xinput_driver_t xinput_driver<P>::table PROGMEM = {P::parse, P::rumble, P::led, P::digest_skip};
 
-    //Wireless controllers havent been allocated yet, work out the type at the device level.
-    xinput_type_t _dev_type = (dev_type == XBOX360_WIRELESS) ? dev_type : _xpad->type;
-    switch(_dev_type)
+//Triggers and sticks of the XUSB style reports, LT/RT bytes then four shorts.
+template <uint8_t TRIGGERS, uint8_t STICKS>
+static inline void xinput_decode_axes(usbh_xinput_t *xpad, const uint8_t *data)
+{
+    xpad->pad_state.bLeftTrigger = data[TRIGGERS];
+    xpad->pad_state.bRightTrigger = data[TRIGGERS + 1];
+    xpad->pad_state.sThumbLX = GET_SHORT(&data, STICKS);
+    xpad->pad_state.sThumbLY = GET_SHORT(&data, STICKS + 2);
+    xpad->pad_state.sThumbRX = GET_SHORT(&data, STICKS + 4);
+    xpad->pad_state.sThumbRY = GET_SHORT(&data, STICKS + 6);
+}
+
+//Defaults, a protocol overrides what it supports.
+struct xinput_protocol
+{
+    static const uint8_t digest_skip = XINPUT_DIGEST_SKIP_NONE;
+    static uint8_t rumble(uint8_t *buf, uint8_t lValue, uint8_t rValue) { return 0; }
+    static uint8_t led(uint8_t *buf, uint8_t quadrant) { return 0; }
+};
+
+//Claimed so nothing else grabs the device, reports are ignored.
+struct xinput_idle_protocol : xinput_protocol
+{
+    static bool parse(XINPUT *dev, usbh_xinput_t **xpad, EpInfo *ep_in, const uint8_t *data, uint16_t len) { return false; }
+};
+
+struct xbox360_wired_protocol : xinput_protocol
+{
+    static bool parse(XINPUT *dev, usbh_xinput_t **xpad, EpInfo *ep_in, const uint8_t *data, uint16_t len)
     {
-    case XBOX360_WIRED:
+        usbh_xinput_t *_xpad = *xpad;
+
         //Controller led_requested feedback
-        if (xdata[0] == 0x01){
+        if (data[0] == 0x01)
+        {
             //Convert it to 1-4, 0 for off.
-            _xpad->led_actual = (xdata[2] & 0x0F);
+            _xpad->led_actual = (data[2] & 0x0F);
             if (_xpad->led_actual != 0)
                 _xpad->led_actual -= (_xpad->led_actual > 5) ? 5 : 1;
-            break;
+            return false;
         }
 
         //Controller rumble feedback
-        else if (xdata[0] == 0x03){
-            _xpad->lValue_actual = xdata[3] << 8;
-            _xpad->rValue_actual = xdata[4] << 8;
-            break;
+        else if (data[0] == 0x03)
+        {
+            _xpad->lValue_actual = data[3];
+            _xpad->rValue_actual = data[4];
+            return false;
         }
 
 #if (0)
         //FIXME, What is this? Happens on connection, I get:
         //0x02 0x03 0x00
-        else if (xdata[0] == 0x02){
-            PrintHex8(xdata,12);
-            break;
+        else if (data[0] == 0x02)
+        {
+            return false;
         }
 
         //FIXME, What is this? Happens on connection, I get:
         //0x08 0x03 0x00
-        else if (xdata[0] == 0x08)
+        else if (data[0] == 0x08)
         {
-            break;
+            return false;
         }
 #endif
 
-        else if (xdata[0] != 0x00)
+        else if (data[0] != 0x00)
         {
             USBH_XINPUT_DEBUG(F("USBH XINPUT: UNKNOWN XBOX360 WIRED COMMAND\n"));
-            break;
+            return false;
         }
 
-        if(xdata[1] != 0x14)
+        if (data[1] != 0x14)
         {
-            break;
+            return false;
         }
 
-        wButtons = GET_USHORT(&xdata, 2);
-
         //Map digital buttons
-        _xpad->pad_state.wButtons = 0x0000;
-        if (wButtons & (1 << 0)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_UP;
-        if (wButtons & (1 << 1)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_DOWN;
-        if (wButtons & (1 << 2)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_LEFT;
-        if (wButtons & (1 << 3)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_RIGHT;
-        if (wButtons & (1 << 4)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_START;
-        if (wButtons & (1 << 5)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_BACK;
-        if (wButtons & (1 << 6)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_LEFT_THUMB;
-        if (wButtons & (1 << 7)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_RIGHT_THUMB;
-        if (wButtons & (1 << 8)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_LEFT_SHOULDER;
-        if (wButtons & (1 << 9)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_RIGHT_SHOULDER;
-        if (wButtons & (1 << 12)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_A;
-        if (wButtons & (1 << 13)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_B;
-        if (wButtons & (1 << 14)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_X;
-        if (wButtons & (1 << 15)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_Y;
+        _xpad->pad_state.wButtons = GET_USHORT(&data, 2) & XBOX360_WIRED_BUTTONS;
 
-        //Map the left and right triggers
-        _xpad->pad_state.bLeftTrigger = xdata[4];
-        _xpad->pad_state.bRightTrigger = xdata[5];
-
-        //Map analog sticks
-        _xpad->pad_state.sThumbLX = GET_SHORT(&xdata, 6);
-        _xpad->pad_state.sThumbLY = GET_SHORT(&xdata, 8);
-        _xpad->pad_state.sThumbRX = GET_SHORT(&xdata, 10);
-        _xpad->pad_state.sThumbRY = GET_SHORT(&xdata, 12);
+        xinput_decode_axes<4, 6>(_xpad, data);
         return true;
-    case XBOX360_WIRELESS:
-        if (xdata[0] & 0x08)
+    }
+
+    static uint8_t rumble(uint8_t *buf, uint8_t lValue, uint8_t rValue)
+    {
+        memcpy_P(buf, xbox360_wired_rumble, sizeof(xbox360_wired_rumble));
+        buf[3] = lValue;
+        buf[4] = rValue;
+        return sizeof(xbox360_wired_rumble);
+    }
+
+    static uint8_t led(uint8_t *buf, uint8_t quadrant)
+    {
+        memcpy_P(buf, xbox360_wired_led, sizeof(xbox360_wired_led));
+        buf[2] = (quadrant == 0) ? 0 : (quadrant + 5);
+        return sizeof(xbox360_wired_led);
+    }
+};
+
+//Bound to the receiver as well as its pads, a pad is only allocated once it connects.
+struct xbox360_wireless_protocol : xinput_protocol
+{
+    static bool parse(XINPUT *dev, usbh_xinput_t **xpad, EpInfo *ep_in, const uint8_t *data, uint16_t len)
+    {
+        usbh_xinput_t *_xpad = *xpad;
+
+        if (data[0] & 0x08)
         {
             //Connected packet
-            if (xdata[1] != 0x00 && _xpad == NULL)
+            if (data[1] != 0x00 && _xpad == NULL)
             {
                 USBH_XINPUT_DEBUG(F("USBH XINPUT: WIRELESS CONTROLLER CONNECTED\n"));
-                 _xpad = alloc_xinput_device(bAddress, 0, &ep_in[0], &ep_in[1], XBOX360_WIRELESS);
-                if (_xpad == NULL)
-                    break;
+                _xpad = dev->alloc_xinput_device(dev->bAddress, 0, &ep_in[0], &ep_in[1], XBOX360_WIRELESS);
             }
             //Disconnected packet
-            else if (xdata[1] == 0x00 && _xpad != NULL)
+            else if (data[1] == 0x00 && _xpad != NULL)
             {
-                free_xinput_device(_xpad);
+                dev->free_xinput_device(_xpad);
                 _xpad = NULL;
             }
+            *xpad = _xpad;
         }
 
         //If you get to here and the controller still isnt allocated, leave!
         if (_xpad == NULL)
         {
-            break;
+            return false;
         }
 
         //Not sure, seems like I need to send chatpad init packets
-        if (xdata[1] == 0xF8)
+        if (data[1] == 0xF8)
         {
             USBH_XINPUT_DEBUG("USBH XINPUT: CHATPAD INIT NEEDED1\n");
             _xpad->chatpad_initialised = 0;
         }
 
         //Controller pad event
-        if ((xdata[1] & 1) && xdata[5] == 0x13)
+        if ((data[1] & 1) && data[5] == 0x13)
         {
-            wButtons = GET_USHORT(&xdata, 6);
             //Map digital buttons
-            _xpad->pad_state.wButtons = 0x0000;
-            if (wButtons & (1 << 0)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_UP;
-            if (wButtons & (1 << 1)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_DOWN;
-            if (wButtons & (1 << 2)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_LEFT;
-            if (wButtons & (1 << 3)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_RIGHT;
-            if (wButtons & (1 << 4)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_START;
-            if (wButtons & (1 << 5)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_BACK;
-            if (wButtons & (1 << 6)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_LEFT_THUMB;
-            if (wButtons & (1 << 7)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_RIGHT_THUMB;
-            if (wButtons & (1 << 8)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_LEFT_SHOULDER;
-            if (wButtons & (1 << 9)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_RIGHT_SHOULDER;
-            if (wButtons & (1 << 10)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_XBOX_BUTTON;
-            if (wButtons & (1 << 12)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_A;
-            if (wButtons & (1 << 13)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_B;
-            if (wButtons & (1 << 14)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_X;
-            if (wButtons & (1 << 15)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_Y;
-
-            //Map the left and right triggers
-            _xpad->pad_state.bLeftTrigger = xdata[8];
-            _xpad->pad_state.bRightTrigger = xdata[9];
-
-            //Map analog sticks
-            _xpad->pad_state.sThumbLX = GET_SHORT(&xdata, 10);
-            _xpad->pad_state.sThumbLY = GET_SHORT(&xdata, 12);
-            _xpad->pad_state.sThumbRX = GET_SHORT(&xdata, 14);
-            _xpad->pad_state.sThumbRY = GET_SHORT(&xdata, 16);
+            _xpad->pad_state.wButtons = GET_USHORT(&data, 6) & XBOX360_WIRELESS_BUTTONS;
+
+            xinput_decode_axes<8, 10>(_xpad, data);
         }
 
         //Chatpad report
-        if ((xdata[1] & 2))
+        if ((data[1] & 2))
         {
             //Chatpad Button data
-            if(xdata[24] == 0x00)
+            if (data[24] == 0x00)
             {
-                for (uint8_t i = 0; i < 3; i++)
-                {
-                    _xpad->chatpad_state[i] = xdata[25 + i];
-                }
+                xinput_chatpad_update(_xpad, &data[25]);
             }
 
             //Chatpad Status packet
-            if (xdata[24] == 0xF0)
+            if (data[24] == 0xF0)
             {
-                if (xdata[25] == 0x03)
+                if (data[25] == 0x03)
                 {
                     USBH_XINPUT_DEBUG("USBH XINPUT: CHATPAD INIT NEEDED2\n");
                     _xpad->chatpad_initialised = 0;
                 }
                 //LED status
-                if (xdata[25] == 0x04)
+                if (data[25] == 0x04)
                 {
-                    if (xdata[26] & 0x80)
+                    if (data[26] & 0x80)
                     {
-                        _xpad->chatpad_led_actual = xdata[26] & 0x7F;
+                        _xpad->chatpad_led_actual = data[26] & 0x7F;
                     }
                 }
             }
         }
 
         return true;
-    case XBOXONE:
-        if (xdata[0] != 0x20)
+    }
+
+    static uint8_t rumble(uint8_t *buf, uint8_t lValue, uint8_t rValue)
+    {
+        memset(buf, 0x00, 12);
+        memcpy_P(buf, xbox360w_rumble, sizeof(xbox360w_rumble));
+        buf[5] = lValue;
+        buf[6] = rValue;
+        return 12;
+    }
+
+    static uint8_t led(uint8_t *buf, uint8_t quadrant)
+    {
+        memset(buf, 0x00, 12);
+        memcpy_P(buf, xbox360w_led, sizeof(xbox360w_led));
+        buf[3] = (quadrant == 0) ? 0x40 : (0x40 | (quadrant + 5));
+        return 12;
+    }
+};
+
+struct xboxone_protocol : xinput_protocol
+{
+    static const uint8_t digest_skip = 2; //Sequence counter
+    static bool parse(XINPUT *dev, usbh_xinput_t **xpad, EpInfo *ep_in, const uint8_t *data, uint16_t len)
+    {
+        usbh_xinput_t *_xpad = *xpad;
+
+        if (data[0] != 0x20)
         {
-            break;
+            return false;
         }
 
-        wButtons = GET_USHORT(&xdata, 4);
-
         //Map digital buttons
-        _xpad->pad_state.wButtons = 0x0000;
-        if (wButtons & (1 << 8)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_UP;
-        if (wButtons & (1 << 9)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_DOWN;
-        if (wButtons & (1 << 10)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_LEFT;
-        if (wButtons & (1 << 11)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_RIGHT;
-        if (wButtons & (1 << 2)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_START;
-        if (wButtons & (1 << 3)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_BACK;
-        if (wButtons & (1 << 14)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_LEFT_THUMB;
-        if (wButtons & (1 << 15)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_RIGHT_THUMB;
-        if (wButtons & (1 << 12)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_LEFT_SHOULDER;
-        if (wButtons & (1 << 13)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_RIGHT_SHOULDER;
-        if (wButtons & (1 << 4)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_A;
-        if (wButtons & (1 << 5)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_B;
-        if (wButtons & (1 << 6)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_X;
-        if (wButtons & (1 << 7)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_Y;
+        _xpad->pad_state.wButtons = pgm_read_word(&xboxone_buttons_lo[data[4]]) |
+                                    pgm_read_word(&xboxone_buttons_hi[data[5]]);
 
         //Map the left and right triggers
-        _xpad->pad_state.bLeftTrigger = GET_USHORT(&xdata, 6) >> 2;
-        _xpad->pad_state.bRightTrigger = GET_USHORT(&xdata, 8) >> 2;
+        _xpad->pad_state.bLeftTrigger = GET_USHORT(&data, 6) >> 2;
+        _xpad->pad_state.bRightTrigger = GET_USHORT(&data, 8) >> 2;
 
         //Map analog sticks
-        _xpad->pad_state.sThumbLX = GET_SHORT(&xdata, 10);
-        _xpad->pad_state.sThumbLY = GET_SHORT(&xdata, 12);
-        _xpad->pad_state.sThumbRX = GET_SHORT(&xdata, 14);
-        _xpad->pad_state.sThumbRY = GET_SHORT(&xdata, 16);
+        _xpad->pad_state.sThumbLX = GET_SHORT(&data, 10);
+        _xpad->pad_state.sThumbLY = GET_SHORT(&data, 12);
+        _xpad->pad_state.sThumbRX = GET_SHORT(&data, 14);
+        _xpad->pad_state.sThumbRY = GET_SHORT(&data, 16);
         return true;
-    case XBOXOG:
-        if (xdata[1] != 0x14)
+    }
+
+    static uint8_t rumble(uint8_t *buf, uint8_t lValue, uint8_t rValue)
+    {
+        memcpy_P(buf, xboxone_rumble, sizeof(xboxone_rumble));
+        buf[8] = lValue / 2.6f; //Scale is 0 to 100
+        buf[9] = rValue / 2.6f; //Scale is 0 to 100
+        return sizeof(xboxone_rumble);
+    }
+
+};
+
+struct xboxog_protocol : xinput_protocol
+{
+    static bool parse(XINPUT *dev, usbh_xinput_t **xpad, EpInfo *ep_in, const uint8_t *data, uint16_t len)
+    {
+        usbh_xinput_t *_xpad = *xpad;
+
+        if (data[1] != 0x14)
         {
-            break;
+            return false;
         }
-  
-        wButtons = GET_USHORT(&xdata, 2);
 
         //Map digital buttons
-        _xpad->pad_state.wButtons = 0x0000;
-        if (wButtons & (1 << 0)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_UP;
-        if (wButtons & (1 << 1)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_DOWN;
-        if (wButtons & (1 << 2)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_LEFT;
-        if (wButtons & (1 << 3)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_DPAD_RIGHT;
-        if (wButtons & (1 << 4)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_START;
-        if (wButtons & (1 << 5)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_BACK;
-        if (wButtons & (1 << 6)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_LEFT_THUMB;
-        if (wButtons & (1 << 7)) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_RIGHT_THUMB;
-
-        if (xdata[4] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_A;
-        if (xdata[5] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_B;
-        if (xdata[6] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_X;
-        if (xdata[7] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_Y;
-        if (xdata[8] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_RIGHT_SHOULDER;
-        if (xdata[9] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_LEFT_SHOULDER;
+        _xpad->pad_state.wButtons = data[2] & XBOXOG_BUTTONS;
 
-        //Map the left and right triggers
-        _xpad->pad_state.bLeftTrigger = xdata[10];
-        _xpad->pad_state.bRightTrigger = xdata[11];
+        if (data[4] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_A;
+        if (data[5] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_B;
+        if (data[6] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_X;
+        if (data[7] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_Y;
+        if (data[8] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_RIGHT_SHOULDER;
+        if (data[9] > 0x20) _xpad->pad_state.wButtons |= XINPUT_GAMEPAD_LEFT_SHOULDER;
 
-        //Map analog sticks
-        _xpad->pad_state.sThumbLX = GET_SHORT(&xdata, 12);
-        _xpad->pad_state.sThumbLY = GET_SHORT(&xdata, 14);
-        _xpad->pad_state.sThumbRX = GET_SHORT(&xdata, 16);
-        _xpad->pad_state.sThumbRY = GET_SHORT(&xdata, 18);   
+        xinput_decode_axes<10, 12>(_xpad, data);
         return true;
-    case XINPUT_KEYBOARD:
+    }
+
+    static uint8_t rumble(uint8_t *buf, uint8_t lValue, uint8_t rValue)
+    {
+        memcpy_P(buf, xboxog_rumble, sizeof(xboxog_rumble));
+        buf[2] = lValue;
+        buf[3] = lValue;
+        buf[4] = rValue;
+        buf[5] = rValue;
+        return sizeof(xboxog_rumble);
+    }
+
+};
+
+struct xinput_keyboard_protocol : xinput_protocol
+{
+    static bool parse(XINPUT *dev, usbh_xinput_t **xpad, EpInfo *ep_in, const uint8_t *data, uint16_t len)
+    {
         Serial1.println("KB: ");
-        //PrintHex8(xdata, 8);
         return true;
-    case XINPUT_MOUSE:
+    }
+};
+
+struct xinput_mouse_protocol : xinput_protocol
+{
+    static bool parse(XINPUT *dev, usbh_xinput_t **xpad, EpInfo *ep_in, const uint8_t *data, uint16_t len)
+    {
         Serial1.println("MS: ");
-        //PrintHex8(xdata, 8);
         return true;
-    default:
-        return false;
     }
+};
 #pragma GCC diagnostic pop
-    return false;
+
+static const xinput_driver_t *xinput_get_driver(xinput_type_t type)
+{
+    switch (type)
+    {
+#ifndef DISABLE_USBH_XBOXONE
+    case XBOXONE:
+        return &xinput_driver<xboxone_protocol>::table;
+#endif
+#ifndef DISABLE_USBH_XBOX360_WIRELESS
+    case XBOX360_WIRELESS:
+        return &xinput_driver<xbox360_wireless_protocol>::table;
+#endif
+#ifndef DISABLE_USBH_XBOX360_WIRED
+    case XBOX360_WIRED:
+        return &xinput_driver<xbox360_wired_protocol>::table;
+#endif
+#ifndef DISABLE_USBH_XBOXOG
+    case XBOXOG:
+        return &xinput_driver<xboxog_protocol>::table;
+#endif
+#ifndef DISABLE_USBH_HID
+    case XINPUT_KEYBOARD:
+        return &xinput_driver<xinput_keyboard_protocol>::table;
+    case XINPUT_MOUSE:
+        return &xinput_driver<xinput_mouse_protocol>::table;
+    case XINPUT_8BITDO_IDLE:
+        return &xinput_driver<xinput_idle_protocol>::table;
+#endif
+    default:
+        return NULL;
+    }
 }
 
-uint8_t XINPUT::WritePacket(usbh_xinput_t *xpad, const uint8_t *data, uint8_t len, uint8_t flags)
+//cmd is the XINPUT_OUT_x command the packet is sent for, 0 for vendor init packets
+uint8_t XINPUT::WritePacket(usbh_xinput_t *xpad, const uint8_t *data, uint8_t len, uint8_t flags, uint8_t cmd)
 {
-    xpad->timer_out = millis();
+    FinishTransfers(0); //Frees xdata
     if (flags & TRANSFER_PGM)
     {
         memcpy_P(xdata, data, len);
@@ -925,72 +1771,60 @@ uint8_t XINPUT::WritePacket(usbh_xinput_t *xpad, const uint8_t *data, uint8_t le
         memcpy(xdata, data, len);
     }
 
-    return pUsb->outTransfer(bAddress, xpad->usbh_outPipe->epAddr, len, xdata);
+    return StartTransfer(xpad->usbh_outPipe, len, cmd);
 }
 
-uint8_t XINPUT::SetRumble(usbh_xinput_t *xpad, uint8_t lValue, uint8_t rValue)
+//Wireless pads need a few packets every XINPUT_MAINT_PERIOD_MS to stay connected and keep the
+//chatpad awake. They go out one per call, as the lowest priority output command.
+uint8_t XINPUT::SendMaintenance(usbh_xinput_t *xpad)
 {
-    xpad->lValue_actual = xpad->lValue_requested;
-    xpad->rValue_actual = xpad->rValue_requested;
-    xpad->timer_out = millis();
-    uint16_t len;
-    switch (xpad->type)
+    uint8_t rcode;
+    switch (xpad->maint_step)
     {
-    case XBOX360_WIRELESS:
-        memset(xdata, 0x00, 12);
-        memcpy_P(xdata, xbox360w_rumble, sizeof(xbox360w_rumble));
-        xdata[5] = lValue;
-        xdata[6] = rValue;
-        len = 12;
-        break;
-    case XBOX360_WIRED:
-        memcpy_P(xdata, xbox360_wired_rumble, sizeof(xbox360_wired_rumble));
-        xdata[3] = lValue;
-        xdata[4] = rValue;
-        len = sizeof(xbox360_wired_rumble);
+    case 0:
+        xpad->timer_periodic = millis();
+        rcode = WritePacket(xpad, xbox360w_inquire_present, sizeof(xbox360w_inquire_present), TRANSFER_PGM, XINPUT_OUT_MAINTENANCE);
         break;
-    case XBOXONE:
-        memcpy_P(xdata, xboxone_rumble, sizeof(xboxone_rumble));
-        xdata[8] = lValue / 2.6f; //Scale is 0 to 100
-        xdata[9] = rValue / 2.6f; //Scale is 0 to 100
-        len = sizeof(xboxone_rumble);
+    case 1:
+        rcode = WritePacket(xpad, xbox360w_controller_info, sizeof(xbox360w_controller_info), TRANSFER_PGM, XINPUT_OUT_MAINTENANCE);
         break;
-    case XBOXOG:
-        memcpy_P(xdata, xboxog_rumble, sizeof(xboxog_rumble));
-        xdata[2] = lValue;
-        xdata[3] = lValue;
-        xdata[4] = rValue;
-        xdata[5] = rValue;
-        len = sizeof(xboxog_rumble);
+    case 2:
+        rcode = SetLed(xpad, xpad->led_requested);
         break;
     default:
-        return hrSUCCESS;
+        rcode = (xpad->chatpad_keepalive_toggle ^= 1) ?
+                    WritePacket(xpad, xbox360w_chatpad_keepalive1, sizeof(xbox360w_chatpad_keepalive1), TRANSFER_PGM, XINPUT_OUT_MAINTENANCE) :
+                    WritePacket(xpad, xbox360w_chatpad_keepalive2, sizeof(xbox360w_chatpad_keepalive2), TRANSFER_PGM, XINPUT_OUT_MAINTENANCE);
+        break;
     }
+    xpad->maint_step = (xpad->maint_step + 1) & 3;
+    return rcode;
+}
 
-    return pUsb->outTransfer(bAddress, xpad->usbh_outPipe->epAddr, len, xdata);
+//The pad's actual values are updated in TransferDone() once the command has been sent.
+uint8_t XINPUT::SetRumble(usbh_xinput_t *xpad, uint8_t lValue, uint8_t rValue)
+{
+    FinishTransfers(0);
+    xinput_rumble_t rumble = (xinput_rumble_t)pgm_read_ptr(&xpad->driver->rumble);
+    uint8_t len = rumble(xdata, lValue, rValue);
+    if (len == 0)
+    {
+        xpad->lValue_actual = lValue;
+        xpad->rValue_actual = rValue;
+        return hrSUCCESS;
+    }
+    return StartTransfer(xpad->usbh_outPipe, len, XINPUT_OUT_RUMBLE, lValue, rValue);
 }
 
 uint8_t XINPUT::SetLed(usbh_xinput_t *xpad, uint8_t quadrant)
 {
-    xpad->led_actual = xpad->led_requested;
-    xpad->timer_out = millis();
-    uint16_t len;
-    switch (xpad->type)
+    FinishTransfers(0);
+    xinput_led_t led = (xinput_led_t)pgm_read_ptr(&xpad->driver->led);
+    uint8_t len = led(xdata, quadrant);
+    if (len == 0)
     {
-    case XBOX360_WIRELESS:
-        memset(xdata, 0x00, 12);
-        memcpy_P(xdata, xbox360w_led, sizeof(xbox360w_led));
-        xdata[3] = (quadrant == 0) ? 0x40 : (0x40 | (quadrant + 5));
-        len = 12;
-        break;
-    case XBOX360_WIRED:
-        memcpy_P(xdata, xbox360_wired_led, sizeof(xbox360_wired_led));
-        xdata[2] = (quadrant == 0) ? 0 : (quadrant + 5);
-        len = sizeof(xbox360_wired_led);
-        break;
-    default:
+        xpad->led_actual = quadrant;
         return hrSUCCESS;
     }
-
-    return pUsb->outTransfer(bAddress, xpad->usbh_outPipe->epAddr, len, xdata);
+    return StartTransfer(xpad->usbh_outPipe, len, XINPUT_OUT_LED, quadrant);
 }
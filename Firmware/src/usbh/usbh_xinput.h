@@ -17,6 +17,17 @@
 #define XINPUT_MAXGAMEPADS 4
 #endif
 
+//Max XINPUT devices connected at once, a wireless receiver is one device for up to four pads
+#ifndef XINPUT_MAX_DEVICES
+#define XINPUT_MAX_DEVICES XINPUT_MAXGAMEPADS
+#endif
+
+//Pipes shared by all XINPUT devices, each device keeps the control pipe and the endpoints it uses.
+//The default fits a wireless receiver plus wired pads (control, IN and OUT) on the other devices.
+#ifndef XINPUT_MAX_PIPES
+#define XINPUT_MAX_PIPES (XBOX_MAX_ENDPOINTS + (XINPUT_MAX_DEVICES - 1) * 3)
+#endif
+
 #ifndef TRANSFER_PGM //Defined in Arduino USB Core normally
 #define TRANSFER_PGM 0x80
 #endif
@@ -93,6 +104,17 @@
 #define XINPUT_CHATPAD_ORANGE 4 
 #define XINPUT_CHATPAD_MESSENGER 8 
 
+//Key codes are 17-127 and the modifiers above are a mask, so they share one 128 bit keymap
+#define XINPUT_CHATPAD_KEYMAP_BYTES 16
+
+//Button translation tables are generated at compile time. BTN_REP256(m) expands m(0) to m(255),
+//m(v) builds the entry for raw byte value v, usually by ORing BTN(v, bit, XINPUT_GAMEPAD_x) terms.
+#define BTN(v, bit, mask) (((v) & (1 << (bit))) ? (mask) : 0)
+#define BTN_REP4(m, n) m(n) m((n) + 1) m((n) + 2) m((n) + 3)
+#define BTN_REP16(m, n) BTN_REP4(m, n) BTN_REP4(m, (n) + 4) BTN_REP4(m, (n) + 8) BTN_REP4(m, (n) + 12)
+#define BTN_REP64(m, n) BTN_REP16(m, n) BTN_REP16(m, (n) + 16) BTN_REP16(m, (n) + 32) BTN_REP16(m, (n) + 48)
+#define BTN_REP256(m) BTN_REP64(m, 0) BTN_REP64(m, 64) BTN_REP64(m, 128) BTN_REP64(m, 192)
+
 typedef struct
 {
     uint16_t wButtons;
@@ -116,6 +138,109 @@ typedef enum
     XINPUT_8BITDO_IDLE
 } xinput_type_t;
 
+class XINPUT;
+typedef struct usbh_xinput_t usbh_xinput_t;
+
+//Protocol handlers for one xinput_type_t, stored in PROGMEM and read with pgm_read_ptr.
+//parse decodes an IN report. *xpad is NULL until a wireless pad connects, the parser may allocate it.
+//rumble and led build an OUT report in buf and return its length, 0 if the protocol has no such command.
+typedef bool (*xinput_parse_t)(XINPUT *dev, usbh_xinput_t **xpad, EpInfo *ep_in, const uint8_t *data, uint16_t len);
+typedef uint8_t (*xinput_rumble_t)(uint8_t *buf, uint8_t lValue, uint8_t rValue);
+typedef uint8_t (*xinput_led_t)(uint8_t *buf, uint8_t quadrant);
+typedef struct
+{
+    xinput_parse_t parse;
+    xinput_rumble_t rumble;
+    xinput_led_t led;
+    uint8_t digest_skip; //Report byte left out of the duplicate report digest, i.e a sequence counter
+} xinput_driver_t;
+
+//Transfer started with XINPUT::StartTransfer() and not finished yet
+typedef struct
+{
+    XINPUT *dev;
+    uint8_t pipe;
+    uint8_t len;    //Buffer size for IN transfers
+    uint8_t cmd;    //XINPUT_OUT_x acknowledged when an OUT transfer succeeds, 0 for none
+    uint8_t arg[2]; //Values the pad holds once cmd is acknowledged
+} xinput_transfer_t;
+
+#define XINPUT_DIGEST_SKIP_NONE 0xFF
+#define XINPUT_SLOT_NONE 0xFF
+
+//Output commands in priority order, see xinput_out_pending()
+#define XINPUT_OUT_RUMBLE (1 << 0)
+#define XINPUT_OUT_LED (1 << 1)
+#define XINPUT_OUT_CHATPAD_INIT (1 << 2)
+#define XINPUT_OUT_CHATPAD_LED (1 << 3)
+#define XINPUT_OUT_POWER_OFF (1 << 4)
+#define XINPUT_OUT_MAINTENANCE (1 << 5)
+#define XINPUT_OUT_KINDS 7 //The commands above plus packets sent without one, i.e. vendor init
+
+#ifndef XINPUT_MAINT_PERIOD_MS
+#define XINPUT_MAINT_PERIOD_MS 1000 //Wireless keep alive cycle
+#endif
+#ifndef XINPUT_MAINT_BUDGET
+#define XINPUT_MAINT_BUDGET 1 //Max maintenance packets per device per usbh_xinput_poll()
+#endif
+
+//IN endpoints that NAK or repeat the last report back off exponentially from bInterval, up to
+//XINPUT_IDLE_POLL_MS for a pad and XINPUT_EMPTY_POLL_MS for an endpoint with no pad, i.e an empty
+//wireless slot. A new report puts the endpoint straight back to bInterval.
+//usbh_xinput_set_idle_poll() replaces XINPUT_IDLE_POLL_MS at runtime, e.g to follow the console's polling interval.
+#ifndef XINPUT_POLL_BUDGET
+#define XINPUT_POLL_BUDGET (XINPUT_MAXGAMEPADS * 2) //Max transfers per usbh_xinput_poll()
+#endif
+#ifndef XINPUT_IDLE_POLL_MS
+#define XINPUT_IDLE_POLL_MS 4 //One console frame at the default XID_INTERVAL_MS
+#endif
+#ifndef XINPUT_EMPTY_POLL_MS
+#define XINPUT_EMPTY_POLL_MS 64
+#endif
+#define XINPUT_BACKOFF_MAX 6
+
+//Devices that enumerated before are recognised by VID/PID/bcdDevice from a small EEPROM table and
+//skip the descriptor reads. Define DISABLE_USBH_XINPUT_CACHE to always enumerate in full.
+#ifndef XINPUT_CACHE_EEPROM_ADDR
+#define XINPUT_CACHE_EEPROM_ADDR 0x10 //master.cpp keeps its settings below this
+#endif
+#ifndef XINPUT_CACHE_ENTRIES
+#define XINPUT_CACHE_ENTRIES 4
+#endif
+#define XINPUT_CACHE_MAX_ITFS 4
+#define XINPUT_CACHE_NONE 0xFF
+#ifndef XINPUT_SET_ADDRESS_MS
+#define XINPUT_SET_ADDRESS_MS 20 //Some devices need longer than the spec allows to settle on their new address
+#endif
+#ifndef XINPUT_CACHED_ADDRESS_MS
+#define XINPUT_CACHED_ADDRESS_MS 2 //SET_ADDRESS recovery time from the USB spec, a cached device has used it before
+#endif
+
+#ifdef ENABLE_USBH_XINPUT_STATS
+//Link telemetry of a pad, reset when the pad is allocated. Read it with usbh_xinput_get_stats().
+#define XINPUT_STATS_BINS 8
+typedef struct
+{
+    uint32_t in_reports;                  //IN transfers that returned a report, changed or not
+    uint32_t in_naks;                     //IN transfers the pad NAKed, it had nothing new
+    uint16_t in_errors;                   //IN transfers that failed with anything else
+    uint16_t out_errors;                  //OUT transfers that failed, NAKs included
+    uint16_t out_sent[XINPUT_OUT_KINDS];  //OUT transfers that succeeded, by XINPUT_OUT_x bit then cmd 0
+    uint16_t interval[XINPUT_STATS_BINS]; //Time between reports, bin n is 2^(n-1) to 2^n-1 ms, bin 0 is under
+                                          //1 ms and the last bin is everything longer. Halved when one fills.
+    uint32_t last_report;                 //millis() of the last report
+    uint32_t rate_reports;                //in_reports at the previous usbh_xinput_get_stats()
+    uint32_t rate_start;                  //millis() at the previous usbh_xinput_get_stats()
+} xinput_stats_t;
+
+typedef struct
+{
+    xinput_stats_t stats;
+    uint32_t age_ms;        //Since the last report
+    uint16_t reports_per_s; //Since the previous usbh_xinput_get_stats() for the pad
+} xinput_stats_report_t;
+#endif
+
 typedef struct usbh_xinput_t
 {
     //usbh backend handles
@@ -124,35 +249,68 @@ typedef struct usbh_xinput_t
     EpInfo *usbh_inPipe;  //Pipe specific to this pad
     EpInfo *usbh_outPipe; //Pipe specific to this pad
     xinput_type_t type;
+    const xinput_driver_t *driver; //Bound in alloc_xinput_device
     //xinput controller state
     xinput_padstate_t pad_state; //Current pad button/stick state
-    uint16_t pad_state_wButtons_old; //Prev pad state buttons
+    uint16_t pad_pressed;        //Buttons that went down since the last usbh_xinput_ack_gamepad_edges
+    uint16_t pad_released;       //Buttons that went up since the last usbh_xinput_ack_gamepad_edges
+    uint16_t pad_held;           //Buttons that are down and were already down at the last ack
+    uint16_t pad_buttons_last;   //wButtons the edges were last computed against
+    uint16_t state_seq;          //Incremented every time a new report is decoded
+    uint16_t report_digest;      //Digest of the last IN report, identical reports are not decoded again
     uint8_t lValue_requested;    //Requested left rumble value
     uint8_t rValue_requested;    //Requested right rumble value
     uint8_t lValue_actual;
     uint8_t rValue_actual;
     uint8_t led_requested;       //Requested led quadrant, 1-4 or 0 for off
     uint8_t led_actual;
+    uint8_t out_last;            //XINPUT_OUT_x command sent last
 
     //Chatpad specific components
     uint8_t chatpad_initialised;
-    uint8_t chatpad_state[3];
-    uint8_t chatpad_state_old[3];
+    uint8_t chatpad_keys[XINPUT_CHATPAD_KEYMAP_BYTES];         //Bit n set if key code n is held, byte 0 is the modifier mask
+    uint8_t chatpad_keys_rising[XINPUT_CHATPAD_KEYMAP_BYTES];  //Pressed and not yet seen by usbh_xinput_was_chatpad_pressed
+    uint8_t chatpad_keys_falling[XINPUT_CHATPAD_KEYMAP_BYTES]; //Released and not yet seen by usbh_xinput_was_chatpad_released
     uint8_t chatpad_led_requested;
     uint8_t chatpad_led_actual;
     uint8_t chatpad_keepalive_toggle;
+    uint8_t maint_step;          //Next packet of the wireless maintenance cycle
 
     //Timers used in usb backend
     uint32_t timer_periodic;
-    uint32_t timer_out;
     uint32_t timer_poweroff;
+
+#ifdef ENABLE_USBH_XINPUT_STATS
+    xinput_stats_t stats;
+#endif
 } usbh_xinput_t;
 
+//Capture record, written for every successful IN transfer when ENABLE_USBH_XINPUT_CAPTURE is defined.
+//Little endian and followed by len bytes of report. sync lets a reader find the next record if it
+//joins the stream part way through.
+#define XINPUT_CAPTURE_SYNC 0xA5
+typedef struct __attribute__((packed))
+{
+    uint8_t sync;
+    uint8_t len;
+    uint32_t timestamp; //micros()
+    uint8_t bAddress;
+    uint8_t epAddr;
+    uint8_t type; //xinput_type_t of the pad, or of the device if no pad is allocated to the endpoint yet
+} xinput_capture_t;
+
 usbh_xinput_t *usbh_xinput_get_device_list(void);
 uint8_t usbh_xinput_is_chatpad_pressed(usbh_xinput_t *xinput, uint16_t code);
 uint8_t usbh_xinput_is_gamepad_pressed(usbh_xinput_t *xinput, uint16_t button_mask);
 uint8_t usbh_xinput_was_chatpad_pressed(usbh_xinput_t *xinput, uint16_t code);
-uint8_t usbh_xinput_was_gamepad_pressed(usbh_xinput_t *xinput, uint16_t button_mask);
+uint8_t usbh_xinput_was_chatpad_released(usbh_xinput_t *xinput, uint16_t code);
+void usbh_xinput_ack_gamepad_edges(usbh_xinput_t *xinput);
+void usbh_xinput_finish_transfers(usbh_xinput_t *xinput);
+void usbh_xinput_poll(void);
+void usbh_xinput_set_idle_poll(uint8_t ms);
+#ifdef ENABLE_USBH_XINPUT_STATS
+uint8_t usbh_xinput_get_stats(usbh_xinput_t *xinput, xinput_stats_report_t *report);
+#endif
 
 //Wired 360 commands
 static const uint8_t xbox360_wired_rumble[] PROGMEM = {0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
@@ -196,6 +354,43 @@ static const uint8_t chatpad_mod[] PROGMEM =     {CHATPAD_CAPSLOCK, CHATPAD_GREE
 static const uint8_t chatpad_led_on[] PROGMEM =  {0x08,             0x09,          0x0A,           0x0B};
 static const uint8_t chatpad_led_off[] PROGMEM = {0x00,             0x01,          0x02,           0x03};
 
+//Supported interface found by xinput_conf_parser, its endpoints are already in XINPUT::epInfo
+typedef struct
+{
+    uint8_t itf_num;
+    xinput_type_t type;
+    uint8_t in_pipe;  //0 if the interface has no interrupt IN endpoint
+    uint8_t out_pipe; //0 if the interface has no interrupt OUT endpoint
+} xinput_itf_t;
+
+//Walks the configuration descriptor as the control pipe streams it in, so it never has to fit in RAM.
+//Interrupt endpoints of supported interfaces are registered in the device's epInfo as they are found.
+class xinput_conf_parser : public USBReadParser
+{
+public:
+    xinput_conf_parser(XINPUT *dev, uint16_t vid);
+    void Reset(XINPUT *dev, uint16_t vid);
+    void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset);
+
+    xinput_itf_t itfs[XBOX_MAX_ENDPOINTS - 1];
+    uint8_t num_itfs;
+    uint8_t num_eps;    //Control pipe plus the endpoints of itfs
+    bool malformed;     //A descriptor had a bLength below 2, the rest can't be walked
+
+private:
+    XINPUT *dev;
+    uint16_t vid;
+    uint8_t itf_left;   //Interface descriptors still to be looked at, from bNumInterfaces of the configuration
+    uint8_t desc[sizeof(USB_INTERFACE_DESCRIPTOR)];
+    uint8_t desc_len;
+    uint8_t desc_pos;
+    xinput_itf_t *itf;  //Interface the next endpoint descriptors belong to, NULL if it isn't supported
+    uint8_t first_pipe;
+    uint8_t ep_num;
+    uint8_t ep_count;
+    void Descriptor(void);
+};
+
 class XINPUT : public USBDeviceConfig
 {
 public:
@@ -214,21 +409,49 @@ public:
     };
     uint8_t SetRumble(usbh_xinput_t *xpad, uint8_t lValue, uint8_t rValue);
     uint8_t SetLed(usbh_xinput_t *xpad, uint8_t quadrant);
-    uint8_t WritePacket(usbh_xinput_t *xpad, const uint8_t *data, uint8_t len, uint8_t flags);
+    uint8_t WritePacket(usbh_xinput_t *xpad, const uint8_t *data, uint8_t len, uint8_t flags, uint8_t cmd);
+    uint8_t SendMaintenance(usbh_xinput_t *xpad);
+    static void FinishTransfers(uint8_t bAddress);
+    static void PollAll(void);
+    static void FinishEnumeration(void);
 
 protected:
     USB *pUsb;
     uint8_t bAddress;
-    EpInfo epInfo[XBOX_MAX_ENDPOINTS];
+    uint8_t pipe_base;    //First pipe of the shared pool bound to this device
+    uint8_t num_pipes;    //Pipes bound to this device, 0 if it has none
+    EpInfo *epInfo;
+    uint8_t *ep_slot;     //Index into the xinput device list of the pad using each endpoint
+    uint8_t *ep_interval; //bInterval of each endpoint in ms
+    uint16_t *ep_next;    //Low 16 bits of millis() when each endpoint may be used again
+    uint8_t *ep_backoff;  //IN endpoints are polled every bInterval << ep_backoff ms
+    uint8_t ep_rr;        //Endpoint serviced first, the first one skipped when the budget ran out
 
 private:
     bool bIsReady;
+    bool bLowSpeed;
     uint16_t PID,VID;
     uint8_t iProduct, iManuf, iSerial;
     uint8_t dev_num_eps;
     xinput_type_t dev_type;
+    const xinput_driver_t *driver; //Parses reports for endpoints without a pad, wireless receiver only
     usbh_xinput_t *alloc_xinput_device(uint8_t bAddress, uint8_t itf_num, EpInfo *in, EpInfo *out, xinput_type_t type);
     uint8_t free_xinput_device(usbh_xinput_t *xinput_dev);
-    bool ParseInputData(usbh_xinput_t **xpad, EpInfo *ep_in);
+    void set_ep_slot(EpInfo *ep, uint8_t slot);
+    bool ep_due(uint8_t pipe, uint16_t now);
+    void ep_schedule(EpInfo *ep);
+    uint16_t ep_period(uint8_t pipe);
+    void ep_idle(uint8_t pipe);
+    bool Service(uint16_t now, uint8_t *budget);
+    bool bind_pipes(void);
+    void reset_pipes(void);
+    uint8_t cache_load(USB_DEVICE_DESCRIPTOR *udd, xinput_conf_parser *layout, uint8_t *conf_value);
+    void cache_save(uint16_t bcdDevice, xinput_conf_parser *layout, uint8_t conf_value);
+    void cache_forget(uint8_t slot);
+    void EnumStep(void);
+    uint8_t StartTransfer(EpInfo *ep, uint8_t len, uint8_t cmd = 0, uint8_t arg0 = 0, uint8_t arg1 = 0);
+    void TransferDone(const xinput_transfer_t *xfer, uint8_t rcode, uint8_t len);
+    friend struct xbox360_wireless_protocol;
+    friend class xinput_conf_parser;
 };
 #endif
@@ -0,0 +1,81 @@
+// Copyright 2021, Ryan Wendland, ogx360
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifdef ENABLE_USBH_XINPUT_STATS
+
+#include <Arduino.h>
+
+#include "main.h"
+
+//Prints the USB host link telemetry of every allocated pad on Serial1, one line per pad:
+//STATS pad=1 addr=2 type=3 rps=250 age=2 in=12000 nak=40 in_err=0 out_err=0 out=3,1,0,0,0,0,2 hist=0,11000,900,...
+//out= is acknowledged OUT transfers by XINPUT_OUT_x bit then vendor packets, hist= is xinput_stats_t::interval.
+//It is followed by the input reports this module sent to the console and its polling interval:
+//STATS xid interval=4 rps=250
+#ifndef XINPUT_STATS_PERIOD_MS
+#define XINPUT_STATS_PERIOD_MS 1000
+#endif
+
+extern XID_ usbd_xid;
+static uint32_t stats_timer;
+static uint16_t stats_xid_reports;
+
+static void print_list(const __FlashStringHelper *name, const uint16_t *values, uint8_t count)
+{
+    Serial1.print(name);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (i)
+            Serial1.print(',');
+        Serial1.print(values[i]);
+    }
+}
+
+void xinput_stats_task(void)
+{
+    if (millis() - stats_timer < XINPUT_STATS_PERIOD_MS)
+    {
+        return;
+    }
+    stats_timer = millis();
+
+    usbh_xinput_t *usbh_head = usbh_xinput_get_device_list();
+    xinput_stats_report_t report;
+    for (uint8_t i = 0; i < XINPUT_MAXGAMEPADS; i++)
+    {
+        if (!usbh_xinput_get_stats(&usbh_head[i], &report))
+            continue;
+
+        Serial1.print(F("STATS pad="));
+        Serial1.print(i + 1);
+        Serial1.print(F(" addr="));
+        Serial1.print(usbh_head[i].bAddress);
+        Serial1.print(F(" type="));
+        Serial1.print(usbh_head[i].type);
+        Serial1.print(F(" rps="));
+        Serial1.print(report.reports_per_s);
+        Serial1.print(F(" age="));
+        Serial1.print(report.age_ms);
+        Serial1.print(F(" in="));
+        Serial1.print(report.stats.in_reports);
+        Serial1.print(F(" nak="));
+        Serial1.print(report.stats.in_naks);
+        Serial1.print(F(" in_err="));
+        Serial1.print(report.stats.in_errors);
+        Serial1.print(F(" out_err="));
+        Serial1.print(report.stats.out_errors);
+        print_list(F(" out="), report.stats.out_sent, XINPUT_OUT_KINDS);
+        print_list(F(" hist="), report.stats.interval, XINPUT_STATS_BINS);
+        Serial1.println();
+    }
+
+    //Reports are only sent when they change, so this is the rate the console actually gets new input
+    uint16_t xid_reports = usbd_xid.getReportCount();
+    Serial1.print(F("STATS xid interval="));
+    Serial1.print(usbd_xid.getInterval());
+    Serial1.print(F(" rps="));
+    Serial1.println((uint32_t)(uint16_t)(xid_reports - stats_xid_reports) * 1000 / XINPUT_STATS_PERIOD_MS);
+    stats_xid_reports = xid_reports;
+}
+
+#endif